@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "ss.h"
+#include "numtheory.h"
+#include "pool.h"
+
+#define OPTIONS "m:c:t:B:vh"
+
+void synopsis(char *exec) {
+    fprintf(stderr,
+        "SYNOPSIS\n"
+        "   Audits SS public keys for shared prime factors using batch GCD.\n"
+        "   Prints one line per pair of keys that share a factor.\n"
+        "\n"
+        "USAGE\n"
+        "   %s [OPTIONS] [pbfile ...]\n"
+        "\n"
+        "OPTIONS\n"
+        "   -h              Display program help and usage.\n"
+        "   -v              Display verbose program output.\n"
+        "   -m manifest     File listing public key files, one per line.\n"
+        "   -c chunk        Keys held in memory at once (default: 4096).\n"
+        "   -t threads      Worker threads (default: number of cores).\n"
+        "   -B backend      Arithmetic backend: ref, gmp, mpn or auto (default: auto).\n"
+        "\n"
+        "EXIT STATUS\n"
+        "   0 if no keys share a factor, 2 if some do, 1 on errors, including\n"
+        "   any key file that could not be read.\n",
+        exec);
+}
+
+static size_t nthreads = 1;
+
+//
+// Product tree over a chunk of keys. Level 0 holds the keys themselves,
+// each node above is the product of its two children (or a copy of a
+// lone child) up to a single root.
+//
+typedef struct {
+    size_t levels;
+    size_t *width;
+    mpz_t **nodes;
+} Tree;
+
+typedef struct {
+    Tree *tree;
+    size_t level;
+} LevelCtx;
+
+static void build_node(void *arg, size_t i, size_t worker) {
+    (void) worker;
+    LevelCtx *ctx = arg;
+    mpz_t *below = ctx->tree->nodes[ctx->level - 1];
+    size_t below_width = ctx->tree->width[ctx->level - 1];
+    mpz_t *node = &ctx->tree->nodes[ctx->level][i];
+    if (2 * i + 1 < below_width) {
+        mpz_mul(*node, below[2 * i], below[2 * i + 1]);
+    } else {
+        mpz_set(*node, below[2 * i]);
+    }
+}
+
+static void tree_build(Tree *tree, mpz_t *keys, size_t count) {
+    tree->levels = 1;
+    for (size_t w = count; w > 1; w = (w + 1) / 2) {
+        tree->levels++;
+    }
+    tree->width = malloc(tree->levels * sizeof(size_t));
+    tree->nodes = malloc(tree->levels * sizeof(mpz_t *));
+
+    size_t w = count;
+    for (size_t l = 0; l < tree->levels; l++) {
+        tree->width[l] = w;
+        tree->nodes[l] = malloc(w * sizeof(mpz_t));
+        for (size_t i = 0; i < w; i++) {
+            mpz_init(tree->nodes[l][i]);
+        }
+        w = (w + 1) / 2;
+    }
+    for (size_t i = 0; i < count; i++) {
+        mpz_set(tree->nodes[0][i], keys[i]);
+    }
+
+    // nodes of one level are independent of each other
+    for (size_t l = 1; l < tree->levels; l++) {
+        LevelCtx ctx = { tree, l };
+        parallel_for(tree->width[l], build_node, &ctx, nthreads);
+    }
+}
+
+static void tree_clear(Tree *tree) {
+    for (size_t l = 0; l < tree->levels; l++) {
+        for (size_t i = 0; i < tree->width[l]; i++) {
+            mpz_clear(tree->nodes[l][i]);
+        }
+        free(tree->nodes[l]);
+    }
+    free(tree->nodes);
+    free(tree->width);
+}
+
+static mpz_t *tree_root(const Tree *tree) {
+    return &tree->nodes[tree->levels - 1][0];
+}
+
+//
+// Remainder tree: reduces x modulo every node from the root down, so each
+// leaf ends up with x mod key, or x mod key^2 when square is set.
+//
+typedef struct {
+    const Tree *tree;
+    size_t level;
+    mpz_t *above;
+    mpz_t *rem;
+    bool square;
+} RemCtx;
+
+static void reduce_node(void *arg, size_t i, size_t worker) {
+    (void) worker;
+    RemCtx *ctx = arg;
+    mpz_t *node = &ctx->tree->nodes[ctx->level][i];
+    if (ctx->square) {
+        mpz_t sq;
+        mpz_init(sq);
+        mpz_mul(sq, *node, *node);
+        mpz_mod(ctx->rem[i], ctx->above[i / 2], sq);
+        mpz_clear(sq);
+    } else {
+        mpz_mod(ctx->rem[i], ctx->above[i / 2], *node);
+    }
+}
+
+// Fills rem[0..count) with the leaf remainders of x
+static void tree_remainders(const Tree *tree, const mpz_t x, bool square, mpz_t *rem) {
+    mpz_t *above = malloc(sizeof(mpz_t));
+    mpz_init_set(above[0], x);
+    size_t above_width = 1;
+
+    for (size_t l = tree->levels; l-- > 0;) {
+        mpz_t *cur = l == 0 ? rem : malloc(tree->width[l] * sizeof(mpz_t));
+        if (l != 0) {
+            for (size_t i = 0; i < tree->width[l]; i++) {
+                mpz_init(cur[i]);
+            }
+        }
+        // the root has no parent, so it reduces x directly
+        RemCtx ctx = { tree, l, above, cur, square };
+        parallel_for(tree->width[l], reduce_node, &ctx, nthreads);
+
+        for (size_t i = 0; i < above_width; i++) {
+            mpz_clear(above[i]);
+        }
+        free(above);
+        if (l == 0) {
+            return;
+        }
+        above = cur;
+        above_width = tree->width[l];
+    }
+}
+
+//
+// A chunk of keys loaded from disk
+//
+typedef struct {
+    size_t first;
+    size_t count;
+    mpz_t *keys;
+    mpz_t *gcds;
+    Tree tree;
+} Chunk;
+
+static char **paths = NULL;
+static size_t npaths = 0;
+
+// Keys that could not be read, reported once and failing the audit
+static bool *unreadable = NULL;
+
+// Loads the keys of paths[first, first + count), unreadable files as 1
+static void chunk_load(Chunk *chunk, size_t first, size_t count) {
+    chunk->first = first;
+    chunk->count = count;
+    chunk->keys = malloc(count * sizeof(mpz_t));
+    chunk->gcds = malloc(count * sizeof(mpz_t));
+    char *username = malloc((LOGIN_NAME_MAX + 1) * sizeof(char));
+
+    for (size_t i = 0; i < count; i++) {
+        mpz_init(chunk->keys[i]);
+        mpz_init_set_ui(chunk->gcds[i], 1);
+        FILE *pbfile = fopen(paths[first + i], "r");
+        bool ok = false;
+        if (pbfile != NULL) {
+            ok = ss_read_pub(chunk->keys[i], username, pbfile)
+                 && mpz_cmp_ui(chunk->keys[i], 1) > 0;
+            fclose(pbfile);
+        }
+        if (!ok) {
+            // a key of 1 is neutral in the products and never shares a factor
+            mpz_set_ui(chunk->keys[i], 1);
+            if (!unreadable[first + i]) {
+                unreadable[first + i] = true;
+                fprintf(stderr, "Failed to read public key %s.\n", paths[first + i]);
+            }
+        }
+    }
+
+    free(username);
+    tree_build(&chunk->tree, chunk->keys, count);
+}
+
+static void chunk_clear(Chunk *chunk) {
+    tree_clear(&chunk->tree);
+    for (size_t i = 0; i < chunk->count; i++) {
+        mpz_clears(chunk->keys[i], chunk->gcds[i], NULL);
+    }
+    free(chunk->keys);
+    free(chunk->gcds);
+}
+
+typedef struct {
+    Chunk *chunk;
+    mpz_t *rem;
+    bool self;
+} GcdCtx;
+
+// gcd of a key with the product of the other keys, its remainder being
+// taken modulo key^2 when the key is part of that product
+static void leaf_gcd(void *arg, size_t i, size_t worker) {
+    (void) worker;
+    GcdCtx *ctx = arg;
+    mpz_t *key = &ctx->chunk->keys[i];
+    if (ctx->self) {
+        mpz_divexact(ctx->rem[i], ctx->rem[i], *key);
+    }
+    gcd(ctx->rem[i], *key, ctx->rem[i]);
+    // fold into what earlier chunk pairs found
+    mpz_lcm(ctx->chunk->gcds[i], ctx->chunk->gcds[i], ctx->rem[i]);
+}
+
+// Computes for every key of chunk the gcd with the root of other, which
+// is chunk itself when self is set
+static void chunk_scan(Chunk *chunk, const Chunk *other, bool self) {
+    mpz_t *rem = malloc(chunk->count * sizeof(mpz_t));
+    for (size_t i = 0; i < chunk->count; i++) {
+        mpz_init(rem[i]);
+    }
+    tree_remainders(&chunk->tree, *tree_root(&other->tree), self, rem);
+    GcdCtx ctx = { chunk, rem, self };
+    parallel_for(chunk->count, leaf_gcd, &ctx, nthreads);
+    for (size_t i = 0; i < chunk->count; i++) {
+        mpz_clear(rem[i]);
+    }
+    free(rem);
+}
+
+//
+// Keys found to share a factor with some other key
+//
+static bool *is_flagged = NULL;
+static size_t *flagged = NULL;
+static mpz_t *flagged_keys = NULL;
+static size_t nflagged = 0;
+
+static void collect_flagged(Chunk *chunk) {
+    for (size_t i = 0; i < chunk->count; i++) {
+        if (mpz_cmp_ui(chunk->gcds[i], 1) > 0 && !is_flagged[chunk->first + i]) {
+            is_flagged[chunk->first + i] = true;
+            flagged = realloc(flagged, (nflagged + 1) * sizeof(size_t));
+            flagged_keys = realloc(flagged_keys, (nflagged + 1) * sizeof(mpz_t));
+            flagged[nflagged] = chunk->first + i;
+            mpz_init_set(flagged_keys[nflagged], chunk->keys[i]);
+            nflagged++;
+        }
+    }
+}
+
+static void add_path(const char *path) {
+    paths = realloc(paths, (npaths + 1) * sizeof(char *));
+    paths[npaths++] = strdup(path);
+}
+
+int main(int argc, char **argv) {
+    // default values
+    FILE *manifest = NULL;
+    size_t chunk_size = 4096;
+    bool verbose = false;
+    nthreads = pool_default_threads();
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'm':
+            manifest = fopen(optarg, "r");
+            if (manifest == NULL) {
+                printf("Failed to open %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c': chunk_size = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+        case 't': nthreads = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+        case 'B':
+            if (!backend_select(optarg)) {
+                printf("Unknown backend %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'v': verbose = true; break;
+        case 'h': synopsis(argv[0]); return 0;
+        default: synopsis(argv[0]); return 1;
+        }
+    }
+
+    // gather the key files from the manifest and the command line
+    if (manifest != NULL) {
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+        while ((len = getline(&line, &cap, manifest)) > 0) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0') {
+                add_path(line);
+            }
+        }
+        free(line);
+        fclose(manifest);
+    }
+    for (int i = optind; i < argc; i++) {
+        add_path(argv[i]);
+    }
+    if (npaths == 0) {
+        synopsis(argv[0]);
+        return 1;
+    }
+
+    is_flagged = calloc(npaths, sizeof(bool));
+    unreadable = calloc(npaths, sizeof(bool));
+
+    // Only two chunks are in memory at a time. Every chunk is scanned
+    // against itself, then against each later chunk in both directions.
+    size_t nchunks = (npaths + chunk_size - 1) / chunk_size;
+    for (size_t a = 0; a < nchunks; a++) {
+        Chunk outer;
+        size_t first = a * chunk_size;
+        chunk_load(&outer, first, npaths - first < chunk_size ? npaths - first : chunk_size);
+        chunk_scan(&outer, &outer, true);
+
+        for (size_t b = a + 1; b < nchunks; b++) {
+            Chunk inner;
+            size_t ifirst = b * chunk_size;
+            chunk_load(
+                &inner, ifirst, npaths - ifirst < chunk_size ? npaths - ifirst : chunk_size);
+            chunk_scan(&outer, &inner, false);
+            chunk_scan(&inner, &outer, false);
+            collect_flagged(&inner);
+            chunk_clear(&inner);
+        }
+
+        collect_flagged(&outer);
+        if (verbose) {
+            printf("chunk %zu/%zu scanned, %zu keys flagged so far\n", a + 1, nchunks, nflagged);
+        }
+        chunk_clear(&outer);
+    }
+
+    // flagged keys are few, so pairing them up directly is cheap
+    mpz_t g;
+    mpz_init(g);
+    size_t pairs = 0;
+    for (size_t i = 0; i < nflagged; i++) {
+        for (size_t j = i + 1; j < nflagged; j++) {
+            gcd(g, flagged_keys[i], flagged_keys[j]);
+            if (mpz_cmp_ui(g, 1) > 0) {
+                gmp_printf("%s %s %Zx\n", paths[flagged[i]], paths[flagged[j]], g);
+                pairs++;
+            }
+        }
+    }
+    size_t nunreadable = 0;
+    for (size_t i = 0; i < npaths; i++) {
+        nunreadable += unreadable[i];
+    }
+    if (verbose) {
+        printf("%zu keys audited, %zu pairs share a factor\n", npaths - nunreadable, pairs);
+    }
+    if (nunreadable > 0) {
+        fprintf(stderr, "%zu key files could not be read.\n", nunreadable);
+    }
+
+    // clear variables
+    mpz_clear(g);
+    for (size_t i = 0; i < nflagged; i++) {
+        mpz_clear(flagged_keys[i]);
+    }
+    free(flagged_keys);
+    free(flagged);
+    free(is_flagged);
+    free(unreadable);
+    for (size_t i = 0; i < npaths; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    // a skipped key could hide a shared factor, so it fails the audit
+    if (nunreadable > 0) {
+        return 1;
+    }
+    return pairs > 0 ? 2 : 0;
+}
@@ -0,0 +1,163 @@
+#include "batch.h"
+#include "pool.h"
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static void filelist_add(FileList *list, const char *path) {
+    list->paths = realloc(list->paths, (list->count + 1) * sizeof(char *));
+    list->paths[list->count++] = strdup(path);
+}
+
+bool filelist_manifest(FileList *list, const char *manifest) {
+    FILE *file = fopen(manifest, "r");
+    if (file == NULL) {
+        return false;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, file) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0') {
+            filelist_add(list, line);
+        }
+    }
+    free(line);
+    fclose(file);
+    return true;
+}
+
+static bool ends_with(const char *name, const char *suffix) {
+    size_t n = strlen(name);
+    size_t s = strlen(suffix);
+    return n >= s && strcmp(name + n - s, suffix) == 0;
+}
+
+bool filelist_dir(FileList *list, const char *dir, const char *suffix, bool with_suffix) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return false;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (ends_with(entry->d_name, suffix) != with_suffix) {
+            continue;
+        }
+        size_t len = strlen(dir) + strlen(entry->d_name) + 2;
+        char *path = malloc(len);
+        snprintf(path, len, "%s/%s", dir, entry->d_name);
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            filelist_add(list, path);
+        }
+        free(path);
+    }
+    closedir(d);
+    return true;
+}
+
+void filelist_clear(FileList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    list->paths = NULL;
+    list->count = 0;
+}
+
+// State shared by the workers of one batch_run
+typedef struct {
+    const FileList *list;
+    outpath_fn outpath;
+    batch_fn fn;
+    const void *ctx;
+    bool verbose;
+    SSScratch *scratch;
+    atomic_size_t failed;
+    atomic_uint_fast64_t bytes;
+} Run;
+
+// Processes one file, false if it could not be opened or fn failed
+static bool run_file(Run *run, const char *inpath, SSScratch *scratch) {
+    FILE *infile = fopen(inpath, "r");
+    if (infile == NULL) {
+        return false;
+    }
+    char *outpath = run->outpath(inpath);
+    FILE *outfile = fopen(outpath, "w");
+    free(outpath);
+    if (outfile == NULL) {
+        fclose(infile);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fileno(infile), &st) == 0) {
+        atomic_fetch_add(&run->bytes, (uint64_t) st.st_size);
+    }
+    bool ok = run->fn(infile, outfile, scratch, run->ctx);
+    fclose(infile);
+    // a failed close means buffered output was lost
+    return fclose(outfile) == 0 && ok;
+}
+
+static void run_task(void *arg, size_t i, size_t worker) {
+    Run *run = arg;
+    const char *inpath = run->list->paths[i];
+    if (!run_file(run, inpath, &run->scratch[worker])) {
+        atomic_fetch_add(&run->failed, 1);
+        fprintf(stderr, "FAILED %s\n", inpath);
+    } else if (run->verbose) {
+        fprintf(stderr, "ok %s\n", inpath);
+    }
+}
+
+int batch_run(const FileList *list, outpath_fn outpath, batch_fn fn, const void *ctx,
+    size_t nthreads, size_t cache, bool verbose) {
+    Run run = { .list = list, .outpath = outpath, .fn = fn, .ctx = ctx, .verbose = verbose };
+    atomic_init(&run.failed, 0);
+    atomic_init(&run.bytes, 0);
+
+    // one scratch per worker, reused for every file it takes
+    if (nthreads > list->count) {
+        nthreads = list->count;
+    }
+    if (nthreads == 0) {
+        nthreads = 1;
+    }
+    run.scratch = malloc(nthreads * sizeof(SSScratch));
+    for (size_t t = 0; t < nthreads; t++) {
+        ss_scratch_init(&run.scratch[t]);
+        // without memory for the cache the files are still processed, uncached
+        ss_scratch_cache(&run.scratch[t], cache);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    parallel_for(list->count, run_task, &run, nthreads);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double mb = atomic_load(&run.bytes) / 1e6;
+    size_t failed = atomic_load(&run.failed);
+    fprintf(stderr, "%zu files, %zu failed, %.2f MB in %.2f s (%.1f files/s, %.2f MB/s)\n",
+        list->count, failed, mb, secs, secs > 0 ? list->count / secs : 0.0,
+        secs > 0 ? mb / secs : 0.0);
+    uint64_t hits = 0, misses = 0;
+    for (size_t t = 0; t < nthreads; t++) {
+        hits += run.scratch[t].cache_hits;
+        misses += run.scratch[t].cache_misses;
+        ss_scratch_clear(&run.scratch[t]);
+    }
+    free(run.scratch);
+    if (verbose && cache > 0) {
+        fprintf(stderr, "block cache: %" PRIu64 " hits, %" PRIu64 " misses\n", hits, misses);
+    }
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ss.h"
+
+//
+// Input files of a batch run.
+// Zero initialize before adding files and release with filelist_clear.
+//
+typedef struct {
+    char **paths;
+    size_t count;
+} FileList;
+
+//
+// Adds every non-empty line of a manifest file as an input path.
+//
+// Returns false if the manifest can not be opened.
+//
+bool filelist_manifest(FileList *list, const char *manifest);
+
+//
+// Adds the regular files of dir, only those whose names end with suffix
+// if with_suffix is set and only those that do not otherwise.
+//
+// Returns false if the directory can not be opened.
+//
+bool filelist_dir(FileList *list, const char *dir, const char *suffix, bool with_suffix);
+
+void filelist_clear(FileList *list);
+
+//
+// Processes one open input into one open output, scratch belonging to the
+// calling worker thread. Returns false if the file failed.
+//
+typedef bool (*batch_fn)(FILE *infile, FILE *outfile, SSScratch *scratch, const void *ctx);
+
+//
+// Returns the newly allocated output path for an input path.
+//
+typedef char *(*outpath_fn)(const char *inpath);
+
+//
+// Runs fn over every file of list on a pool of nthreads workers.
+//
+// Each worker's scratch gets a block cache of cache entries, none if 0.
+// Prints every failed file, every file and the cache hits when verbose
+// is set, and a throughput summary to stderr.
+//
+// Returns 0 if every file succeeded and 1 otherwise.
+//
+int batch_run(const FileList *list, outpath_fn outpath, batch_fn fn, const void *ctx,
+    size_t nthreads, size_t cache, bool verbose);
@@ -2,12 +2,15 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "ss.h"
 #include "randstate.h"
 #include "numtheory.h"
+#include "batch.h"
+#include "pool.h"
 
-#define OPTIONS "i:o:n:vh"
+#define OPTIONS "i:o:n:lm:D:j:B:vh"
 
 void synopsis(char *exec) {
     fprintf(stderr,
@@ -23,16 +26,58 @@ void synopsis(char *exec) {
         "   -v              Display verbose program output.\n"
         "   -i infile       Input file of data to encrypt (default: stdin).\n"
         "   -o outfile      Output file for encrypted data (default: stdout).\n"
-        "   -n pbfile       Public key file (default: ss.priv).\n",
+        "   -n pbfile       Public key file (default: ss.priv).\n"
+        "   -l              Low latency, decrypt the two halves of each block in parallel.\n"
+        "   -B backend      Arithmetic backend: ref, gmp, mpn or auto (default: auto).\n"
+        "   -m manifest     Batch mode, decrypt every file listed in manifest.\n"
+        "   -D dir          Batch mode, decrypt every file in dir ending in .ss.\n"
+        "   -j threads      Worker threads for batch mode (default: number of cores).\n"
+        "\n"
+        "   In batch mode each file is decrypted into the same path without .ss,\n"
+        "   or plus .dec if it does not end in .ss.\n",
         exec);
 }
 
+// Private key shared by the batch workers
+typedef struct {
+    mpz_srcptr d;
+    mpz_srcptr pq;
+    mpz_srcptr p;
+    mpz_srcptr q;
+    bool crt;
+    bool low_latency;
+} Key;
+
+// Batch output path, the input path without .ss or plus .dec
+static char *decrypted_path(const char *inpath) {
+    size_t len = strlen(inpath);
+    char *path = malloc(len + 5);
+    if (len > 3 && strcmp(inpath + len - 3, ".ss") == 0) {
+        snprintf(path, len + 5, "%.*s", (int) (len - 3), inpath);
+    } else {
+        snprintf(path, len + 5, "%s.dec", inpath);
+    }
+    return path;
+}
+
+static bool decrypt_one(FILE *infile, FILE *outfile, SSScratch *scratch, const void *ctx) {
+    const Key *key = ctx;
+    bool ok = key->crt ? ss_decrypt_file_crt_r(
+                  infile, outfile, key->d, key->p, key->q, key->low_latency, scratch)
+                       : ss_decrypt_file_r(infile, outfile, key->d, key->pq, scratch);
+    return ok && !ferror(infile);
+}
+
 int main(int argc, char **argv) {
     // default values
     FILE *input = NULL;
     FILE *output = NULL;
     FILE *pvfile = NULL;
     bool verbose = false;
+    bool low_latency = false;
+    FileList files = { NULL, 0 };
+    bool batch = false;
+    size_t nthreads = pool_default_threads();
 
     int opt = 0;
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
@@ -58,12 +103,39 @@ int main(int argc, char **argv) {
                 return 1;
             }
             break;
+        case 'l': low_latency = true; break;
+        case 'm':
+            batch = true;
+            if (!filelist_manifest(&files, optarg)) {
+                printf("Failed to open %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'D':
+            batch = true;
+            if (!filelist_dir(&files, optarg, ".ss", true)) {
+                printf("Failed to open %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'j': nthreads = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+        case 'B':
+            if (!backend_select(optarg)) {
+                printf("Unknown backend %s.\n", optarg);
+                return 1;
+            }
+            break;
         case 'v': verbose = true; break;
         case 'h': synopsis(argv[0]); return 0;
         default: synopsis(argv[0]); return 1;
         }
     }
 
+    if (batch && (input != NULL || output != NULL)) {
+        printf("Batch mode takes no -i or -o.\n");
+        return 1;
+    }
+
     // open default files if not specified
     if (pvfile == NULL) {
         pvfile = fopen("ss.priv", "r");
@@ -80,10 +152,15 @@ int main(int argc, char **argv) {
     }
 
     // initialize mpz_t variables
-    mpz_t pq, d, bits;
-    mpz_inits(pq, d, bits, NULL);
+    mpz_t pq, d, p, q, bits;
+    mpz_inits(pq, d, p, q, bits, NULL);
 
     ss_read_priv(pq, d, pvfile);
+    // keys from older keygen versions lack the factors needed for CRT
+    bool crt = ss_read_priv_factors(p, q, pq, pvfile);
+    if (low_latency && !crt) {
+        fprintf(stderr, "Private key has no factors, decrypting without -l.\n");
+    }
 
     if (verbose) {
         mpz_set_ui(bits, mpz_sizeinbase(pq, 2));
@@ -92,12 +169,25 @@ int main(int argc, char **argv) {
         gmp_printf("d (%Zd bits) = %Zd\n", bits, d);
     }
 
-    // encrypt input file
-    ss_decrypt_file(input, output, d, pq);
+    bool ok;
+    if (batch) {
+        // many files under one key, loaded once
+        Key key = { d, pq, p, q, crt, low_latency };
+        ok = batch_run(&files, decrypted_path, decrypt_one, &key, nthreads, 0, verbose) == 0;
+    } else {
+        // decrypt input file
+        ok = crt ? ss_decrypt_file_crt(input, output, d, p, q, low_latency)
+                 : ss_decrypt_file(input, output, d, pq);
+        if (!ok) {
+            printf("Failed to decompress the decrypted data.\n");
+        }
+    }
 
     //close files and clear variables
-    mpz_clears(pq, d, bits, NULL);
+    mpz_clears(pq, d, p, q, bits, NULL);
+    filelist_clear(&files);
     fclose(input);
     fclose(output);
     fclose(pvfile);
+    return ok ? 0 : 1;
 }
@@ -3,12 +3,19 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
 
 #include "ss.h"
 #include "randstate.h"
 #include "numtheory.h"
+#include "lz.h"
+#include "batch.h"
+#include "pool.h"
 
-#define OPTIONS "i:o:n:vh"
+#define OPTIONS "i:o:n:zac:m:D:j:B:vh"
 
 void synopsis(char *exec) {
     fprintf(stderr,
@@ -24,16 +31,199 @@ void synopsis(char *exec) {
         "   -v              Display verbose program output.\n"
         "   -i infile       Input file of data to encrypt (default: stdin).\n"
         "   -o outfile      Output file for encrypted data (default: stdout).\n"
-        "   -n pbfile       Public key file (default: ss.pub).\n",
+        "   -n pbfile       Public key file (default: ss.pub).\n"
+        "   -z              Compress the data before encrypting it.\n"
+        "   -a              Append mode, encrypt only what was added to infile since\n"
+        "                   the last run, tracked in outfile.state.\n"
+        "   -B backend      Arithmetic backend: ref, gmp, mpn or auto (default: auto).\n"
+        "   -c entries      Reuse the ciphertext of up to entries repeated blocks\n"
+        "                   (at most 1048576).\n"
+        "   -m manifest     Batch mode, encrypt every file listed in manifest.\n"
+        "   -D dir          Batch mode, encrypt every file in dir not ending in .ss.\n"
+        "   -j threads      Worker threads for batch mode or several keys\n"
+        "                   (default: number of cores).\n"
+        "\n"
+        "   -n and -o may be repeated to encrypt for several recipients in one\n"
+        "   pass, the i-th -o receiving the data encrypted with the i-th -n.\n"
+        "   In batch mode each file is encrypted into the same path plus .ss.\n",
         exec);
 }
 
+// One public key and the output encrypted under it
+typedef struct {
+    FILE *pbfile;
+    FILE *output;
+    const char *outpath;
+    mpz_t n;
+    char *username;
+} Recipient;
+
+// Recipients shared by the workers, each keeping its own scratch
+typedef struct {
+    Recipient *recipients;
+    const uint8_t *buf;
+    size_t len;
+    bool compressed;
+    SSScratch *scratch;
+} Job;
+
+static void encrypt_task(void *arg, size_t i, size_t worker) {
+    Job *job = arg;
+    Recipient *r = &job->recipients[i];
+    if (job->compressed) {
+        ss_encrypt_lz_r(job->buf, job->len, r->output, r->n, &job->scratch[worker]);
+    } else {
+        ss_encrypt_buffer_r(job->buf, job->len, r->output, r->n, &job->scratch[worker]);
+    }
+}
+
+// Reads all of input into a single buffer
+static uint8_t *read_all(FILE *input, size_t *len) {
+    size_t cap = 1 << 16;
+    uint8_t *buf = malloc(cap);
+    size_t r;
+    *len = 0;
+    while ((r = fread(buf + *len, 1, cap - *len, input)) > 0) {
+        *len += r;
+        if (*len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+    }
+    return buf;
+}
+
+// Batch output path, the input path plus .ss
+static char *encrypted_path(const char *inpath) {
+    size_t len = strlen(inpath) + 4;
+    char *path = malloc(len);
+    snprintf(path, len, "%s.ss", inpath);
+    return path;
+}
+
+static bool encrypt_one(FILE *infile, FILE *outfile, SSScratch *scratch, const void *ctx) {
+    ss_encrypt_file_r(infile, outfile, ctx, scratch);
+    return !ferror(infile);
+}
+
+static bool encrypt_one_lz(FILE *infile, FILE *outfile, SSScratch *scratch, const void *ctx) {
+    size_t len;
+    uint8_t *buf = read_all(infile, &len);
+    uint8_t *lzbuf = malloc(lz_bound(len));
+    size_t lzlen = lz_compress(buf, len, lzbuf);
+    ss_encrypt_lz_r(lzbuf, lzlen, outfile, ctx, scratch);
+    free(lzbuf);
+    free(buf);
+    return !ferror(infile);
+}
+
+// Opens the ciphertext of an append run and cuts it back to the last
+// complete block recorded in st, fails if the files no longer match st
+static FILE *open_append(const char *outpath, FILE *input, const SSAppendState *st) {
+    FILE *output = fopen(outpath, "r+");
+    if (output == NULL) {
+        output = fopen(outpath, "w+");
+    }
+    if (output == NULL) {
+        printf("Failed to open %s.\n", outpath);
+        return NULL;
+    }
+    struct stat in, out;
+    fstat(fileno(input), &in);
+    fstat(fileno(output), &out);
+    if ((uint64_t) in.st_size < st->in_off + st->partial) {
+        printf("Input is shorter than when %s was written.\n", outpath);
+        fclose(output);
+        return NULL;
+    }
+    if ((uint64_t) out.st_size < st->out_off) {
+        printf("%s is shorter than its state says.\n", outpath);
+        fclose(output);
+        return NULL;
+    }
+    if (ftruncate(fileno(output), st->out_off) != 0
+        || fseeko(output, st->out_off, SEEK_SET) != 0
+        || fseeko(input, st->in_off, SEEK_SET) != 0) {
+        printf("Failed to seek %s.\n", outpath);
+        fclose(output);
+        return NULL;
+    }
+    return output;
+}
+
+// Encrypts the input appended since the last run into outpath,
+// the state is replaced only once the new ciphertext is on disk
+static int encrypt_append(FILE *input, const char *outpath, const mpz_t n, bool verbose) {
+    size_t len = strlen(outpath) + 11;
+    char *stpath = malloc(len);
+    char *tmppath = malloc(len);
+    snprintf(stpath, len, "%s.state", outpath);
+    snprintf(tmppath, len, "%s.state.tmp", outpath);
+
+    SSAppendState st = { ss_fingerprint(n), 0, 0, 0 };
+    FILE *stfile = fopen(stpath, "r");
+    if (stfile != NULL) {
+        bool ok = ss_read_append_state(&st, stfile);
+        fclose(stfile);
+        if (!ok || st.key != ss_fingerprint(n)) {
+            printf("%s is corrupt or belongs to another key.\n", stpath);
+            free(stpath);
+            free(tmppath);
+            return 1;
+        }
+    }
+
+    int status = 1;
+    uint64_t start = st.in_off;
+    FILE *output = open_append(outpath, input, &st);
+    if (output != NULL) {
+        ss_encrypt_append(input, output, n, &st);
+        bool written = !ferror(input) && fflush(output) == 0 && fsync(fileno(output)) == 0;
+        written = fclose(output) == 0 && written;
+        stfile = written ? fopen(tmppath, "w") : NULL;
+        if (stfile != NULL) {
+            ss_write_append_state(&st, stfile);
+            if (fclose(stfile) == 0 && rename(tmppath, stpath) == 0) {
+                status = 0;
+            }
+        }
+        if (status != 0) {
+            printf("Failed to write %s.\n", stpath);
+        } else if (verbose) {
+            printf("encrypted %" PRIu64 " bytes from offset %" PRIu64 ", %" PRIu64
+                   " in the trailing block\n",
+                st.in_off + st.partial - start, start, st.partial);
+        }
+    }
+    free(stpath);
+    free(tmppath);
+    return status;
+}
+
+// Grows the recipient list by one entry
+static Recipient *add_recipient(Recipient *list, size_t *count) {
+    list = realloc(list, (*count + 1) * sizeof(Recipient));
+    list[*count].pbfile = NULL;
+    list[*count].output = NULL;
+    list[*count].outpath = NULL;
+    *count += 1;
+    return list;
+}
+
 int main(int argc, char **argv) {
     // default values
     FILE *input = NULL;
-    FILE *output = NULL;
-    FILE *pbfile = NULL;
+    Recipient *recipients = NULL;
+    size_t nkeys = 0;
+    size_t nouts = 0;
     bool verbose = false;
+    bool compress = false;
+    bool append = false;
+    size_t cache = 0;
+    FileList files = { NULL, 0 };
+    bool batch = false;
+    size_t nthreads = pool_default_threads();
+    int status = 0;
 
     int opt = 0;
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
@@ -46,29 +236,98 @@ int main(int argc, char **argv) {
             }
             break;
         case 'o':
-            output = fopen(optarg, "w");
-            if (output == NULL) {
+            if (nouts == nkeys) {
+                recipients = add_recipient(recipients, &nkeys);
+            }
+            recipients[nouts++].outpath = optarg;
+            break;
+        case 'n': {
+            // pair with an -o given before this key if there is one
+            size_t i = nkeys;
+            for (size_t j = 0; j < nkeys; j++) {
+                if (recipients[j].pbfile == NULL) {
+                    i = j;
+                    break;
+                }
+            }
+            if (i == nkeys) {
+                recipients = add_recipient(recipients, &nkeys);
+            }
+            recipients[i].pbfile = fopen(optarg, "r");
+            if (recipients[i].pbfile == NULL) {
                 printf("Failed to open %s.\n", optarg);
                 return 1;
             }
             break;
-        case 'n':
-            pbfile = fopen(optarg, "r");
-            if (pbfile == NULL) {
+        }
+        case 'z': compress = true; break;
+        case 'a': append = true; break;
+        case 'c': {
+            char *end;
+            errno = 0;
+            unsigned long long entries = strtoull(optarg, &end, 10);
+            if (errno != 0 || *end != '\0' || end == optarg || entries > SS_CACHE_MAX) {
+                printf("Cache entries must be a number from 0 to %zu.\n", SS_CACHE_MAX);
+                return 1;
+            }
+            cache = entries;
+            break;
+        }
+        case 'm':
+            batch = true;
+            if (!filelist_manifest(&files, optarg)) {
                 printf("Failed to open %s.\n", optarg);
                 return 1;
             }
             break;
+        case 'D':
+            batch = true;
+            if (!filelist_dir(&files, optarg, ".ss", false)) {
+                printf("Failed to open %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'j': nthreads = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+        case 'B':
+            if (!backend_select(optarg)) {
+                printf("Unknown backend %s.\n", optarg);
+                return 1;
+            }
+            break;
         case 'v': verbose = true; break;
         case 'h': synopsis(argv[0]); return 0;
         default: synopsis(argv[0]); return 1;
         }
     }
 
+    if (batch && (input != NULL || nouts > 0 || nkeys > 1)) {
+        printf("Batch mode takes a single public key and no -i or -o.\n");
+        return 1;
+    }
+
+    if (append && (compress || batch || nkeys > 1 || input == NULL || nouts == 0)) {
+        printf("Append mode takes one -i, -o and key, and no -z.\n");
+        return 1;
+    }
+
     // open default files if not specified
-    if (pbfile == NULL) {
-        pbfile = fopen("ss.pub", "r");
-        if (pbfile == NULL) {
+    if (nkeys == 0) {
+        recipients = add_recipient(recipients, &nkeys);
+    }
+    if (nkeys > 1 && nouts != nkeys) {
+        printf("Each public key needs its own output file.\n");
+        return 1;
+    }
+    // only a lone recipient may fall back to ss.pub
+    for (size_t i = 0; i < nkeys; i++) {
+        if (recipients[i].pbfile == NULL && nkeys > 1) {
+            printf("Each output file needs its own public key.\n");
+            return 1;
+        }
+    }
+    if (recipients[0].pbfile == NULL) {
+        recipients[0].pbfile = fopen("ss.pub", "r");
+        if (recipients[0].pbfile == NULL) {
             printf("Failed to open ss.pub.\n");
             return 1;
         }
@@ -76,30 +335,113 @@ int main(int argc, char **argv) {
     if (input == NULL) {
         input = stdin;
     }
-    if (output == NULL) {
-        output = stdout;
+    for (size_t i = 0; i < nouts && !append; i++) {
+        recipients[i].output = fopen(recipients[i].outpath, "w");
+        if (recipients[i].output == NULL) {
+            printf("Failed to open %s.\n", recipients[i].outpath);
+            return 1;
+        }
+    }
+    if (recipients[0].output == NULL && !append) {
+        recipients[0].output = stdout;
     }
 
     // initialize mpz_t variables
-    mpz_t n, bits;
-    mpz_inits(n, bits, NULL);
+    mpz_t bits;
+    mpz_init(bits);
 
-    char *username = malloc((LOGIN_NAME_MAX + 1) * sizeof(char));
-    ss_read_pub(n, username, pbfile);
+    for (size_t i = 0; i < nkeys; i++) {
+        Recipient *r = &recipients[i];
+        mpz_init(r->n);
+        r->username = malloc((LOGIN_NAME_MAX + 1) * sizeof(char));
+        if (!ss_read_pub(r->n, r->username, r->pbfile)) {
+            printf("Failed to read public key.\n");
+            return 1;
+        }
 
-    if (verbose) {
-        printf("user = %s\n", username);
-        mpz_set_ui(bits, mpz_sizeinbase(n, 2));
-        gmp_printf("n (%Zd bits) = %Zd\n", bits, n);
+        if (verbose) {
+            printf("user = %s\n", r->username);
+            mpz_set_ui(bits, mpz_sizeinbase(r->n, 2));
+            gmp_printf("n (%Zd bits) = %Zd\n", bits, r->n);
+        }
     }
 
-    // encrypt input file
-    ss_encrypt_file(input, output, n);
+    if (append) {
+        // only the input added since the last run
+        status = encrypt_append(input, recipients[0].outpath, recipients[0].n, verbose);
+    } else if (batch) {
+        // many files under one key, loaded once
+        status = batch_run(&files, encrypted_path, compress ? encrypt_one_lz : encrypt_one,
+            recipients[0].n, nthreads, cache, verbose);
+    } else if (nkeys == 1 && !compress) {
+        // encrypt input file
+        SSScratch scratch;
+        ss_scratch_init(&scratch);
+        if (!ss_scratch_cache(&scratch, cache)) {
+            fprintf(stderr, "Failed to allocate the block cache.\n");
+            ss_scratch_clear(&scratch);
+            return 1;
+        }
+        ss_encrypt_file_r(input, recipients[0].output, recipients[0].n, &scratch);
+        if (verbose && cache > 0) {
+            printf("block cache: %" PRIu64 " hits, %" PRIu64 " misses\n", scratch.cache_hits,
+                scratch.cache_misses);
+        }
+        ss_scratch_clear(&scratch);
+    } else {
+        // read input once and encrypt it for every key in parallel
+        Job job = { .recipients = recipients, .compressed = compress };
+        uint8_t *buf = read_all(input, &job.len);
+
+        // compress once, every key encrypts the same compressed bytes
+        if (compress) {
+            uint8_t *lzbuf = malloc(lz_bound(job.len));
+            size_t lzlen = lz_compress(buf, job.len, lzbuf);
+            if (verbose) {
+                printf("compressed %zu bytes to %zu bytes\n", job.len, lzlen);
+            }
+            free(buf);
+            buf = lzbuf;
+            job.len = lzlen;
+        }
+        job.buf = buf;
+
+        if (nthreads > nkeys) {
+            nthreads = nkeys;
+        }
+        job.scratch = malloc(nthreads * sizeof(SSScratch));
+        for (size_t t = 0; t < nthreads; t++) {
+            ss_scratch_init(&job.scratch[t]);
+            // without memory for the cache the keys are still encrypted, uncached
+            ss_scratch_cache(&job.scratch[t], cache);
+        }
+        parallel_for(nkeys, encrypt_task, &job, nthreads);
+
+        uint64_t hits = 0, misses = 0;
+        for (size_t t = 0; t < nthreads; t++) {
+            hits += job.scratch[t].cache_hits;
+            misses += job.scratch[t].cache_misses;
+            ss_scratch_clear(&job.scratch[t]);
+        }
+        free(job.scratch);
+        free(buf);
+        if (verbose && cache > 0) {
+            printf("block cache: %" PRIu64 " hits, %" PRIu64 " misses\n", hits, misses);
+        }
+    }
 
     //close files and clear variables
-    free(username);
-    mpz_clears(n, bits, NULL);
+    for (size_t i = 0; i < nkeys; i++) {
+        free(recipients[i].username);
+        mpz_clear(recipients[i].n);
+        if (recipients[i].output != NULL) {
+            fclose(recipients[i].output);
+        }
+        fclose(recipients[i].pbfile);
+    }
+    free(recipients);
+    filelist_clear(&files);
+    mpz_clear(bits);
     fclose(input);
-    fclose(output);
-    fclose(pbfile);
+    return status;
 }
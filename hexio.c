@@ -0,0 +1,305 @@
+#include "hexio.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HEX_SSE2 1
+#endif
+
+// the AVX2 path is compiled with its own target attribute, so it only
+// needs an x86 compiler that understands it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HEX_AVX2 1
+#endif
+
+#define LIMB_BYTES sizeof(mp_limb_t)
+
+static const char digits[] = "0123456789abcdef";
+
+void hexbuf_init(HexBuf *hb) {
+    memset(hb, 0, sizeof *hb);
+}
+
+void hexbuf_clear(HexBuf *hb) {
+    free(hb->line);
+    free(hb->bytes);
+    memset(hb, 0, sizeof *hb);
+}
+
+// grows a buffer to hold at least need bytes
+static void *reserve(void *buf, size_t *cap, size_t need) {
+    if (*cap >= need) {
+        return buf;
+    }
+    size_t len = *cap ? *cap : 64;
+    while (len < need) {
+        len *= 2;
+    }
+    buf = realloc(buf, len);
+    *cap = len;
+    return buf;
+}
+
+// value of hex digit c, -1 if c is not a hex digit
+static inline int nibble(unsigned char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+//
+// Scalar reference converters, also used for the tails of the SIMD loops.
+//
+
+static void encode_scalar(char *out, const uint8_t *in, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[2 * i] = digits[in[i] >> 4];
+        out[2 * i + 1] = digits[in[i] & 0xf];
+    }
+}
+
+static size_t span_scalar(const char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && nibble(s[i]) >= 0) {
+        i++;
+    }
+    return i;
+}
+
+static void decode_scalar(uint8_t *out, const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (uint8_t) (nibble(s[2 * i]) << 4 | nibble(s[2 * i + 1]));
+    }
+}
+
+#ifdef HEX_SSE2
+
+//
+// SSE2 converters, 16 bytes to 32 digits and back per step.
+//
+
+// maps nibbles 0..15 to '0'..'9', 'a'..'f'
+static inline __m128i ascii_sse2(__m128i v) {
+    __m128i letter = _mm_cmpgt_epi8(v, _mm_set1_epi8(9));
+    v = _mm_add_epi8(v, _mm_set1_epi8('0'));
+    return _mm_add_epi8(v, _mm_and_si128(letter, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+static size_t encode_sse2(char *out, const uint8_t *in, size_t n) {
+    const __m128i low = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *) (in + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), low);
+        __m128i lo = _mm_and_si128(b, low);
+        _mm_storeu_si128((__m128i *) (out + 2 * i), ascii_sse2(_mm_unpacklo_epi8(hi, lo)));
+        _mm_storeu_si128((__m128i *) (out + 2 * i + 16), ascii_sse2(_mm_unpackhi_epi8(hi, lo)));
+    }
+    return i;
+}
+
+// converts 16 digits to nibbles, valid gets 0xff in every hex digit lane
+static inline __m128i nibbles_sse2(__m128i c, __m128i *valid) {
+    const __m128i minus1 = _mm_set1_epi8(-1);
+    __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(d, minus1), _mm_cmplt_epi8(d, _mm_set1_epi8(10)));
+    __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(l, minus1), _mm_cmplt_epi8(l, _mm_set1_epi8(6)));
+    *valid = _mm_or_si128(is_digit, is_alpha);
+    l = _mm_add_epi8(l, _mm_set1_epi8(10));
+    return _mm_or_si128(_mm_and_si128(is_digit, d), _mm_and_si128(is_alpha, l));
+}
+
+static size_t span_sse2(const char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i valid;
+        nibbles_sse2(_mm_loadu_si128((const __m128i *) (s + i)), &valid);
+        unsigned mask = (unsigned) _mm_movemask_epi8(valid);
+        if (mask != 0xffff) {
+            return i + (size_t) __builtin_ctz(~mask);
+        }
+    }
+    return i + span_scalar(s + i, n - i);
+}
+
+// joins pairs of nibbles, the even digit being the high half of the byte
+static inline __m128i join_sse2(__m128i v) {
+    __m128i hi = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00ff)), 4);
+    return _mm_or_si128(hi, _mm_srli_epi16(v, 8));
+}
+
+static size_t decode_sse2(uint8_t *out, const char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i valid;
+        __m128i a = nibbles_sse2(_mm_loadu_si128((const __m128i *) (s + 2 * i)), &valid);
+        __m128i b = nibbles_sse2(_mm_loadu_si128((const __m128i *) (s + 2 * i + 16)), &valid);
+        _mm_storeu_si128((__m128i *) (out + i), _mm_packus_epi16(join_sse2(a), join_sse2(b)));
+    }
+    return i;
+}
+
+#endif
+
+#ifdef HEX_AVX2
+
+//
+// AVX2 converters, 32 bytes to 64 digits per step. Compiled for AVX2
+// regardless of the build flags and only called when the CPU has it.
+//
+
+__attribute__((target("avx2"))) static inline __m256i ascii_avx2(__m256i v) {
+    __m256i letter = _mm256_cmpgt_epi8(v, _mm256_set1_epi8(9));
+    v = _mm256_add_epi8(v, _mm256_set1_epi8('0'));
+    return _mm256_add_epi8(v, _mm256_and_si256(letter, _mm256_set1_epi8('a' - '0' - 10)));
+}
+
+__attribute__((target("avx2"))) static size_t encode_avx2(
+    char *out, const uint8_t *in, size_t n) {
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *) (in + i));
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(b, 4), low);
+        __m256i lo = _mm256_and_si256(b, low);
+        // unpack works per 128 bit lane, so swap the middle halves back in order
+        __m256i x = ascii_avx2(_mm256_unpacklo_epi8(hi, lo));
+        __m256i y = ascii_avx2(_mm256_unpackhi_epi8(hi, lo));
+        _mm256_storeu_si256((__m256i *) (out + 2 * i), _mm256_permute2x128_si256(x, y, 0x20));
+        _mm256_storeu_si256(
+            (__m256i *) (out + 2 * i + 32), _mm256_permute2x128_si256(x, y, 0x31));
+    }
+    return i;
+}
+
+#endif
+
+// hex encodes n bytes into 2n digits
+static void encode(char *out, const uint8_t *in, size_t n) {
+    size_t i = 0;
+#ifdef HEX_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        i = encode_avx2(out, in, n);
+    }
+#endif
+#ifdef HEX_SSE2
+    i += encode_sse2(out + 2 * i, in + i, n - i);
+#endif
+    encode_scalar(out + 2 * i, in + i, n - i);
+}
+
+// length of the run of hex digits at the start of s
+static size_t span(const char *s, size_t n) {
+#ifdef HEX_SSE2
+    return span_sse2(s, n);
+#else
+    return span_scalar(s, n);
+#endif
+}
+
+// decodes 2n valid hex digits into n bytes
+static void decode(uint8_t *out, const char *s, size_t n) {
+    size_t i = 0;
+#ifdef HEX_SSE2
+    i = decode_sse2(out, s, n);
+#endif
+    decode_scalar(out + i, s + 2 * i, n - i);
+}
+
+const char *hex_format(const mpz_t x, HexBuf *hb, size_t *len) {
+    size_t limbs = mpz_size(x);
+    size_t nbytes = limbs * LIMB_BYTES;
+
+    // limbs to big endian bytes, most significant limb first
+    hb->bytes = reserve(hb->bytes, &hb->bytes_cap, nbytes);
+    const mp_limb_t *lp = mpz_limbs_read(x);
+    for (size_t i = 0; i < limbs; i++) {
+        mp_limb_t l = lp[limbs - 1 - i];
+        for (size_t j = LIMB_BYTES; j > 0; j--) {
+            hb->bytes[i * LIMB_BYTES + j - 1] = (uint8_t) l;
+            l >>= 8;
+        }
+    }
+
+    hb->line = reserve(hb->line, &hb->line_cap, 2 * nbytes + 2);
+    encode(hb->line, hb->bytes, nbytes);
+
+    // drop leading zeros but keep a single 0 for zero itself
+    size_t start = 0;
+    while (start < 2 * nbytes && hb->line[start] == '0') {
+        start++;
+    }
+    if (start == 2 * nbytes) {
+        hb->line[0] = '0';
+        hb->line[1] = '\n';
+        *len = 2;
+        return hb->line;
+    }
+    hb->line[2 * nbytes] = '\n';
+    *len = 2 * nbytes + 1 - start;
+    return hb->line + start;
+}
+
+void hex_write(FILE *outfile, const mpz_t x, HexBuf *hb) {
+    size_t len;
+    const char *line = hex_format(x, hb, &len);
+    fwrite(line, 1, len, outfile);
+}
+
+bool hex_read(FILE *infile, mpz_t x, HexBuf *hb) {
+    ssize_t len;
+    size_t i = 0;
+
+    // skip blank lines and leading whitespace
+    do {
+        len = getline(&hb->line, &hb->line_cap, infile);
+        if (len < 0) {
+            return false;
+        }
+        i = 0;
+        while (i < (size_t) len && isspace((unsigned char) hb->line[i])) {
+            i++;
+        }
+    } while (i == (size_t) len);
+
+    const char *s = hb->line + i;
+    size_t ndigits = span(s, len - i);
+    if (ndigits == 0) {
+        return false;
+    }
+
+    // an odd digit count leaves a lone high nibble in the first byte
+    size_t nbytes = (ndigits + 1) / 2;
+    hb->bytes = reserve(hb->bytes, &hb->bytes_cap, nbytes);
+    if (ndigits % 2 == 1) {
+        hb->bytes[0] = (uint8_t) nibble(s[0]);
+        decode(hb->bytes + 1, s + 1, nbytes - 1);
+    } else {
+        decode(hb->bytes, s, nbytes);
+    }
+
+    // big endian bytes to limbs, least significant limb first
+    size_t limbs = (nbytes + LIMB_BYTES - 1) / LIMB_BYTES;
+    mp_limb_t *lp = mpz_limbs_write(x, limbs);
+    for (size_t l = 0; l < limbs; l++) {
+        size_t end = nbytes - l * LIMB_BYTES;
+        size_t start = end > LIMB_BYTES ? end - LIMB_BYTES : 0;
+        mp_limb_t limb = 0;
+        for (size_t j = start; j < end; j++) {
+            limb = (limb << 8) | hb->bytes[j];
+        }
+        lp[l] = limb;
+    }
+    mpz_limbs_finish(x, limbs);
+    return true;
+}
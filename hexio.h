@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdio.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Reusable line and byte buffers for hex conversion.
+// Zero initialize with hexbuf_init and release with hexbuf_clear.
+//
+typedef struct {
+    char *line;
+    size_t line_cap;
+    uint8_t *bytes;
+    size_t bytes_cap;
+} HexBuf;
+
+void hexbuf_init(HexBuf *hb);
+
+void hexbuf_clear(HexBuf *hb);
+
+//
+// Format x into hb->line exactly as hex_write prints it.
+//
+// Returns the start of the line, valid until hb is next used, and sets
+// len to its length including the newline.
+//
+// Requires:
+//  x: non-negative integer
+//  hb: initialized buffers
+//
+const char *hex_format(const mpz_t x, HexBuf *hb, size_t *len);
+
+//
+// Write x as lowercase hex followed by a newline, byte for byte the same
+// as gmp_fprintf(outfile, "%Zx\n", x).
+//
+// Requires:
+//  x: non-negative integer
+//  outfile: open and writable file stream
+//  hb: initialized buffers
+//
+void hex_write(FILE *outfile, const mpz_t x, HexBuf *hb);
+
+//
+// Read the next non-blank line of infile and parse its leading hex digits
+// into x, skipping leading whitespace the way gmp_fscanf("%Zx") does.
+//
+// Returns false on end of file or if the line does not start with a
+// hex digit, in which case x is left untouched.
+//
+// Requires:
+//  infile: open and readable file stream
+//  hb: initialized buffers
+//  all mpz_t arguments to be initialized
+//
+bool hex_read(FILE *infile, mpz_t x, HexBuf *hb);
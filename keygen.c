@@ -3,13 +3,18 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <inttypes.h>
 #include <time.h>
+#include <errno.h>
+#include <stdatomic.h>
 
 #include "ss.h"
 #include "randstate.h"
 #include "numtheory.h"
+#include "pool.h"
 
-#define OPTIONS "b:i:n:d:s:vh"
+#define OPTIONS "b:i:n:d:s:r:N:o:j:P:B:vh"
 
 void synopsis(char *exec) {
     fprintf(stderr,
@@ -26,59 +31,158 @@ void synopsis(char *exec) {
         "   -i iterations   Miller-Rabin iterations for testing primes (default: 50).\n"
         "   -n pbfile       Public key file (default: ss.pub).\n"
         "   -d pvfile       Private key file (default: ss.priv).\n"
-        "   -s seed         Random seed for testing.\n",
+        "   -s seed         Random seed for testing.\n"
+        "   -r engine       Random engine: mt or chacha (default: mt).\n"
+        "   -B backend      Arithmetic backend: ref, gmp, mpn or auto (default: auto).\n"
+        "   -N count        Generate count key pairs as dir/ssI.pub and dir/ssI.priv.\n"
+        "   -o dir          Output directory for -N (default: .).\n"
+        "   -j threads      Worker threads for -N (default: number of cores).\n"
+        "   -P threads      Threads sharing the Miller-Rabin rounds of each prime\n"
+        "                   candidate, for very large keys (default: 1).\n",
         exec);
 }
 
+// Key pairs of a -N run, claimed one at a time by the workers
+typedef struct {
+    const char *dir;
+    uint64_t count;
+    uint64_t nbits;
+    uint64_t iters;
+    uint64_t seed;
+    bool verbose;
+    atomic_bool failed;
+} Batch;
+
+// Opens dir/ss<i>.<ext> readable and writable by the user only
+static FILE *open_key_file(const char *dir, uint64_t i, const char *ext) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/ss%" PRIu64 ".%s", dir, i, ext);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        printf("Failed to open %s.\n", path);
+        return NULL;
+    }
+    if (fchmod(fileno(file), S_IRUSR | S_IWUSR) != 0) {
+        printf("Failed to set %s write and read permisions to user.\n", path);
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+static void batch_task(void *arg, size_t i, size_t worker) {
+    (void) worker;
+    Batch *batch = arg;
+    FILE *pbfile = open_key_file(batch->dir, i, "pub");
+    FILE *pvfile = open_key_file(batch->dir, i, "priv");
+    if (pbfile == NULL || pvfile == NULL) {
+        atomic_store(&batch->failed, true);
+        if (pbfile != NULL) {
+            fclose(pbfile);
+        }
+        if (pvfile != NULL) {
+            fclose(pvfile);
+        }
+        return;
+    }
+
+    mpz_t p, q, n, d, pq;
+    mpz_inits(p, q, n, d, pq, NULL);
+
+    // every key gets its own stream, derived from the seed and its index
+    randstate_init_stream(batch->seed, i);
+    ss_make_pub(p, q, n, batch->nbits, batch->iters);
+    ss_make_priv(d, pq, p, q);
+    randstate_clear();
+
+    ss_write_pub(n, getenv("USER"), pbfile);
+    ss_write_priv(pq, d, pvfile);
+    ss_write_priv_factors(p, q, pvfile);
+    fclose(pbfile);
+    fclose(pvfile);
+
+    if (batch->verbose) {
+        printf("%s/ss%zu n (%zu bits)\n", batch->dir, i, mpz_sizeinbase(n, 2));
+    }
+    mpz_clears(p, q, n, d, pq, NULL);
+}
+
+// Generates batch->count key pairs across nthreads threads
+static int make_batch(Batch *batch, size_t nthreads) {
+    if (mkdir(batch->dir, S_IRWXU) != 0 && errno != EEXIST) {
+        printf("Failed to create %s.\n", batch->dir);
+        return 1;
+    }
+    parallel_for(batch->count, batch_task, batch, nthreads);
+    return atomic_load(&batch->failed) ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
     // default values
     uint64_t iters = 50;
     uint64_t nbits = 256;
     FILE *pbfile = NULL;
     FILE *pvfile = NULL;
+    const char *pbname = "ss.pub";
+    const char *pvname = "ss.priv";
     int seed = time(NULL);
     bool verbose = false;
+    uint64_t count = 0;
+    const char *dir = ".";
+    size_t nthreads = pool_default_threads();
 
     int opt = 0;
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
         switch (opt) {
         case 'b': nbits = atoi(optarg); break;
         case 'i': iters = atoi(optarg); break;
-        case 'n':
-            pbfile = fopen(optarg, "w");
-            if (pbfile == NULL) {
-                printf("Failed to open %s.\n", optarg);
+        case 'n': pbname = optarg; break;
+        case 'd': pvname = optarg; break;
+        case 's': seed = atoi(optarg); break;
+        case 'r':
+            if (!randstate_select(optarg)) {
+                printf("Unknown random engine %s.\n", optarg);
                 return 1;
             }
             break;
-        case 'd':
-            pvfile = fopen(optarg, "w");
-            if (pvfile == NULL) {
-                printf("Failed to open %s.\n", optarg);
+        case 'N': count = strtoull(optarg, NULL, 10); break;
+        case 'o': dir = optarg; break;
+        case 'j': nthreads = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+        case 'P': make_prime_threads(atoi(optarg) > 0 ? atoi(optarg) : 1); break;
+        case 'B':
+            if (!backend_select(optarg)) {
+                printf("Unknown backend %s.\n", optarg);
                 return 1;
             }
             break;
-        case 's': seed = atoi(optarg); break;
         case 'v': verbose = true; break;
         case 'h': synopsis(argv[0]); return 0;
         default: synopsis(argv[0]); return 1;
         }
     }
 
-    // open default files if not specified by user
+    // many key pairs in one process
+    if (count > 0) {
+        Batch batch = { .dir = dir,
+            .count = count,
+            .nbits = nbits,
+            .iters = iters,
+            .seed = (uint64_t) seed,
+            .verbose = verbose };
+        atomic_init(&batch.failed, false);
+        return make_batch(&batch, nthreads);
+    }
+
+    // open the key files, ss.pub and ss.priv unless specified by user
+    pbfile = fopen(pbname, "w");
     if (pbfile == NULL) {
-        pbfile = fopen("ss.pub", "w");
-        if (pbfile == NULL) {
-            printf("Failed to open ss.pub.\n");
-            return 1;
-        }
+        printf("Failed to open %s.\n", pbname);
+        return 1;
     }
+    pvfile = fopen(pvname, "w");
     if (pvfile == NULL) {
-        pvfile = fopen("ss.priv", "w");
-        if (pvfile == NULL) {
-            printf("Failed to open ss.priv.\n");
-            return 1;
-        }
+        printf("Failed to open %s.\n", pvname);
+        return 1;
     }
 
     // set file permisions
@@ -106,6 +210,7 @@ int main(int argc, char **argv) {
     // Write keys into respective files
     ss_write_pub(n, getenv("USER"), pbfile);
     ss_write_priv(pq, d, pvfile);
+    ss_write_priv_factors(p, q, pvfile);
 
     // If verbose is enabled print information
     if (verbose) {
@@ -0,0 +1,182 @@
+#include "lz.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Stream layout: the original length as 8 big endian bytes, then a run of
+// sequences. Each sequence is a token whose high nibble is the literal
+// count and low nibble the match length minus MIN_MATCH, the literals, a
+// 2 byte little endian match offset and any length extension bytes. A
+// nibble of 15 means extension bytes follow, each adding its value and
+// stopping at the first one below 255. The final sequence carries only
+// literals.
+//
+
+#define MIN_MATCH  4
+#define MAX_OFFSET 65535
+#define HASH_BITS  14
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint32_t hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// writes the extension bytes for a length whose nibble saturated
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+// writes one sequence, match_len of 0 marking the final literal run
+static uint8_t *put_sequence(
+    uint8_t *op, const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len) {
+    uint8_t *token = op++;
+    size_t ml = match_len ? match_len - MIN_MATCH : 0;
+    *token = (uint8_t) ((lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15));
+    if (lit_len >= 15) {
+        op = put_length(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len) {
+        *op++ = (uint8_t) offset;
+        *op++ = (uint8_t) (offset >> 8);
+        if (ml >= 15) {
+            op = put_length(op, ml - 15);
+        }
+    }
+    return op;
+}
+
+size_t lz_bound(size_t len) {
+    return len + len / 255 + 16 + 8;
+}
+
+size_t lz_compress(const uint8_t *in, size_t len, uint8_t *out) {
+    uint8_t *op = out;
+    for (int i = 7; i >= 0; i--) {
+        *op++ = (uint8_t) ((uint64_t) len >> (8 * i));
+    }
+
+    // position + 1 of the last occurrence of each hashed 4 byte sequence
+    uint32_t *table = calloc((size_t) 1 << HASH_BITS, sizeof(uint32_t));
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    // positions past 4 GiB no longer fit the table, matching stops there
+    while (len >= MIN_MATCH && ip <= len - MIN_MATCH && ip < UINT32_MAX) {
+        uint32_t seq = read32(in + ip);
+        uint32_t h = hash(seq);
+        size_t cand = table[h];
+        table[h] = (uint32_t) (ip + 1);
+
+        if (cand == 0 || ip - (cand - 1) > MAX_OFFSET || read32(in + cand - 1) != seq) {
+            ip++;
+            continue;
+        }
+
+        size_t ref = cand - 1;
+        size_t match_len = MIN_MATCH;
+        while (ip + match_len < len && in[ref + match_len] == in[ip + match_len]) {
+            match_len++;
+        }
+        op = put_sequence(op, in + anchor, ip - anchor, ip - ref, match_len);
+        ip += match_len;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, in + anchor, len - anchor, 0, 0);
+    free(table);
+    return op - out;
+}
+
+// reads extension bytes onto a saturated length, false if input runs out
+static bool get_length(const uint8_t **ip, const uint8_t *end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= end) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+uint8_t *lz_decompress(const uint8_t *in, size_t len, size_t *outlen) {
+    if (len < 8) {
+        return NULL;
+    }
+    uint64_t size = 0;
+    for (int i = 0; i < 8; i++) {
+        size = size << 8 | in[i];
+    }
+    // every extension byte adds at most 255 to a length and the other
+    // bytes of a sequence stand for fewer than 255 bytes each, so the
+    // output is under 255 bytes per input byte and a larger size can only
+    // come from a corrupt header
+    if (size / 255 > len) {
+        return NULL;
+    }
+
+    const uint8_t *ip = in + 8;
+    const uint8_t *end = in + len;
+    uint8_t *out = malloc(size ? size : 1);
+    if (out == NULL) {
+        return NULL;
+    }
+    size_t op = 0;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !get_length(&ip, end, &lit_len)) {
+            break;
+        }
+        if (lit_len > (size_t) (end - ip) || lit_len > size - op) {
+            break;
+        }
+        memcpy(out + op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // the literal only sequence ends the stream
+        if (ip == end) {
+            if (op == size) {
+                *outlen = size;
+                return out;
+            }
+            break;
+        }
+
+        if (end - ip < 2) {
+            break;
+        }
+        size_t offset = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !get_length(&ip, end, &match_len)) {
+            break;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > op || match_len > size - op) {
+            break;
+        }
+        // byte by byte since the match may overlap what it produces
+        for (size_t i = 0; i < match_len; i++, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+
+    free(out);
+    return NULL;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Largest possible size of lz_compress output for len input bytes.
+//
+size_t lz_bound(size_t len);
+
+//
+// Compress len bytes of in with a byte oriented LZ77 coder.
+//
+// Provides:
+//  out: the compressed stream, prefixed with the original length
+//
+// Returns the number of bytes written to out.
+//
+// Requires:
+//  out: room for at least lz_bound(len) bytes
+//
+size_t lz_compress(const uint8_t *in, size_t len, uint8_t *out);
+
+//
+// Decompress a stream produced by lz_compress.
+//
+// Returns a newly allocated buffer holding *outlen bytes, or NULL if the
+// stream is truncated or corrupt. The caller frees the buffer.
+//
+uint8_t *lz_decompress(const uint8_t *in, size_t len, size_t *outlen);
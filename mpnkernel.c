@@ -0,0 +1,176 @@
+#include "mpnkernel.h"
+
+#include <string.h>
+
+// Limbs of a modulus of the given bits. SS moduli overshoot the requested
+// -b by a couple of bits, so every class gets a kernel for this many limbs
+// and one for a limb more.
+#define KERNEL_LIMBS(bits) (((bits) + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS)
+
+// Sliding window width for the exponent, the table holds the odd powers
+// a^1, a^3, ..., a^(2^WINDOW - 1).
+#define WINDOW      5
+#define WINDOW_SIZE (1 << (WINDOW - 1))
+
+// The helpers below are forced inline so that every kernel generated by
+// DEFINE_KERNEL gets its own copy of the loops with mn a constant.
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+// Returns -m0^-1 mod 2^GMP_NUMB_BITS for odd m0. m0 is its own inverse
+// to 3 bits and every Newton step doubles that.
+static mp_limb_t redc_inverse(mp_limb_t m0) {
+    mp_limb_t inv = m0;
+    for (int bits = 3; bits < GMP_NUMB_BITS; bits *= 2) {
+        inv *= 2 - m0 * inv;
+    }
+    return -inv;
+}
+
+// Montgomery reduction: r = t / 2^(mn * GMP_NUMB_BITS) mod m for t < m^2.
+// t is 2 * mn limbs and is overwritten. Each step clears the low limb of t
+// and parks the carry out in the limb it cleared, so the carries are added
+// back in one pass at the end.
+KERNEL_INLINE void redc(mp_limb_t *r, mp_limb_t *t, const mp_limb_t *m, mp_size_t mn,
+    mp_limb_t minv) {
+    for (mp_size_t i = 0; i < mn; i++) {
+        t[i] = mpn_addmul_1(t + i, m, mn, t[i] * minv);
+    }
+    if (mpn_add_n(r, t + mn, t, mn) != 0 || mpn_cmp(r, m, mn) >= 0) {
+        mpn_sub_n(r, r, m, mn);
+    }
+}
+
+// r = a * b / R mod m, every operand being mn limbs long. prod needs
+// 2 * mn limbs of scratch.
+KERNEL_INLINE void mont_mul(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *b,
+    const mp_limb_t *m, mp_size_t mn, mp_limb_t minv, mp_limb_t *prod) {
+    if (a == b) {
+        mpn_sqr(prod, a, mn);
+    } else {
+        mpn_mul_n(prod, a, b, mn);
+    }
+    redc(r, prod, m, mn, minv);
+}
+
+// Returns bit pos of the exponent.
+KERNEL_INLINE unsigned exp_bit(const mp_limb_t *e, mp_bitcnt_t pos) {
+    return (unsigned) (e[pos / GMP_NUMB_BITS] >> (pos % GMP_NUMB_BITS)) & 1;
+}
+
+// Sliding window exponentiation in Montgomery form over caller supplied
+// scratch buffers. table holds WINDOW_SIZE * mn limbs with a * R mod m
+// already in its first entry, acc mn limbs, prod 2 * mn limbs. Leaves
+// a^e mod m in acc, out of Montgomery form.
+KERNEL_INLINE void kernel_pow_mod(mp_limb_t *acc, mp_limb_t *table, const mp_limb_t *e,
+    mp_size_t en, const mp_limb_t *m, mp_size_t mn, mp_limb_t *prod) {
+    mp_limb_t minv = redc_inverse(m[0]);
+
+    // table[i] = a^(2i + 1), acc = a^2 while filling it
+    mont_mul(acc, table, table, m, mn, minv, prod);
+    for (int i = 1; i < WINDOW_SIZE; i++) {
+        mont_mul(table + i * mn, table + (i - 1) * mn, acc, m, mn, minv, prod);
+    }
+
+    // the top bit is set, so the first window starts the accumulator
+    mp_bitcnt_t top = en * GMP_NUMB_BITS - 1;
+    while (exp_bit(e, top) == 0) {
+        top--;
+    }
+    bool started = false;
+    for (mp_bitcnt_t pos = top + 1; pos > 0;) {
+        if (exp_bit(e, pos - 1) == 0) {
+            mont_mul(acc, acc, acc, m, mn, minv, prod);
+            pos--;
+            continue;
+        }
+        // longest window of at most WINDOW bits below pos ending in a 1
+        mp_bitcnt_t low = pos > WINDOW ? pos - WINDOW : 0;
+        while (exp_bit(e, low) == 0) {
+            low++;
+        }
+        unsigned w = 0;
+        for (mp_bitcnt_t b = pos; b > low; b--) {
+            w = w << 1 | exp_bit(e, b - 1);
+        }
+        if (started) {
+            for (mp_bitcnt_t b = pos; b > low; b--) {
+                mont_mul(acc, acc, acc, m, mn, minv, prod);
+            }
+            mont_mul(acc, acc, table + (w >> 1) * mn, m, mn, minv, prod);
+        } else {
+            mpn_copyi(acc, table + (w >> 1) * mn, mn);
+            started = true;
+        }
+        pos = low;
+    }
+
+    // one more reduction of acc alone leaves Montgomery form
+    mpn_copyi(prod, acc, mn);
+    mpn_zero(prod + mn, mn);
+    redc(acc, prod, m, mn, minv);
+}
+
+// Generates pow_mod_<limbs>, a kernel for moduli of exactly that many limbs
+// with the limb count fixed at compile time in all of its loops and its
+// scratch space entirely on the stack. The base goes into Montgomery form
+// by one division of a * R by m.
+#define DEFINE_KERNEL(LIMBS)                                                                  \
+    static void pow_mod_##LIMBS(mp_limb_t *rp, const mp_limb_t *ap, mp_size_t an,            \
+        const mp_limb_t *ep, mp_size_t en, const mp_limb_t *mp) {                             \
+        mp_limb_t table[WINDOW_SIZE * (LIMBS)];                                               \
+        mp_limb_t prod[2 * (LIMBS)];                                                          \
+        mp_limb_t quot[(LIMBS) + 1];                                                          \
+        mpn_zero(prod, 2 * (LIMBS));                                                          \
+        mpn_copyi(prod + (LIMBS), ap, an);                                                    \
+        mpn_tdiv_qr(quot, table, 0, prod, 2 * (LIMBS), mp, (LIMBS));                          \
+        kernel_pow_mod(rp, table, ep, en, mp, (LIMBS), prod);                                 \
+    }
+
+DEFINE_KERNEL(16)
+DEFINE_KERNEL(17)
+DEFINE_KERNEL(32)
+DEFINE_KERNEL(33)
+DEFINE_KERNEL(48)
+DEFINE_KERNEL(49)
+DEFINE_KERNEL(64)
+DEFINE_KERNEL(65)
+
+typedef void (*kernel_fn)(mp_limb_t *, const mp_limb_t *, mp_size_t, const mp_limb_t *,
+    mp_size_t, const mp_limb_t *);
+
+// Picks the kernel for a modulus of mn limbs, NULL if mn is not one of the
+// supported key sizes. Small moduli are left to the generic path where the
+// mpz overhead does not matter as much.
+static kernel_fn kernel_for(mp_size_t mn) {
+    switch (mn) {
+    case KERNEL_LIMBS(1024): return pow_mod_16;
+    case KERNEL_LIMBS(1024) + 1: return pow_mod_17;
+    case KERNEL_LIMBS(2048): return pow_mod_32;
+    case KERNEL_LIMBS(2048) + 1: return pow_mod_33;
+    case KERNEL_LIMBS(3072): return pow_mod_48;
+    case KERNEL_LIMBS(3072) + 1: return pow_mod_49;
+    case KERNEL_LIMBS(4096): return pow_mod_64;
+    case KERNEL_LIMBS(4096) + 1: return pow_mod_65;
+    default: return NULL;
+    }
+}
+
+bool mpn_pow_mod(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n) {
+    mp_size_t mn = mpz_size(n);
+    kernel_fn kernel = kernel_for(mn);
+    // Montgomery reduction needs an odd modulus
+    if (kernel == NULL || mpz_even_p(n) || mpz_sgn(a) < 0 || mpz_sgn(d) <= 0
+        || mpz_cmp(a, n) >= 0) {
+        return false;
+    }
+
+    mp_limb_t result[KERNEL_LIMBS(4096) + 1];
+    kernel(result, mpz_limbs_read(a), mpz_size(a), mpz_limbs_read(d), mpz_size(d),
+        mpz_limbs_read(n));
+
+    // o may alias any input, so it is only written once the kernel is done
+    mp_limb_t *op = mpz_limbs_write(o, mn);
+    mpn_copyi(op, result, mn);
+    mpz_limbs_finish(o, mn);
+    return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdio.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Computes o = a^d mod n with a fixed-size mpn kernel when the size of n
+// matches one of the specialised key sizes (1024, 2048, 3072, 4096 bits).
+// The kernels use Montgomery reduction on stack buffers and never allocate,
+// but they are still slower than mpz_powm, see backend_auto.
+//
+// Returns true if a kernel handled the call. Returns false, leaving o
+// untouched, when no kernel applies or n is even and the generic mpz path
+// must be used.
+//
+// Requires:
+//  0 <= a < n
+//  d > 0
+//  all mpz_t arguments to be initialized
+//
+bool mpn_pow_mod(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n);
@@ -5,6 +5,38 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+//
+// Arithmetic backend: one implementation of each number theory primitive.
+//
+// name: name used to select the backend
+//
+typedef struct {
+    const char *name;
+    void (*gcd)(mpz_t g, const mpz_t a, const mpz_t b);
+    void (*mod_inverse)(mpz_t o, const mpz_t a, const mpz_t n);
+    void (*pow_mod)(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n);
+    bool (*is_prime)(const mpz_t n, uint64_t iters);
+} Backend;
+
+//
+// Selects the backend used by gcd, mod_inverse, pow_mod and is_prime.
+// Must be called before any threads use the number theory functions.
+//
+// Without a call the SS_BACKEND environment variable picks the backend,
+// falling back to auto.
+//
+// name: "ref" (reference loops), "gmp" (GMP built-ins), "mpn" (fixed-size
+//       kernels) or "auto" (currently gmp, the fastest)
+//
+// Returns false if name is not a known backend.
+//
+bool backend_select(const char *name);
+
+//
+// Returns the backend in use.
+//
+const Backend *backend_current(void);
+
 void gcd(mpz_t g, const mpz_t a, const mpz_t b);
 
 void mod_inverse(mpz_t o, const mpz_t a, const mpz_t n);
@@ -13,4 +45,13 @@ void pow_mod(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n);
 
 bool is_prime(const mpz_t n, uint64_t iters);
 
+//
+// Spreads the Miller-Rabin rounds that make_prime runs on a candidate
+// surviving its first round across threads, each round drawing its base
+// from its own stream and all of them stopping once one proves the
+// candidate composite. 1, the default, runs every round on the caller.
+// Must be called before any threads use make_prime.
+//
+void make_prime_threads(size_t threads);
+
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
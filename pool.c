@@ -0,0 +1,65 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+size_t pool_default_threads(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (size_t) cores : 1;
+}
+
+// State shared by the workers of one parallel_for
+typedef struct {
+    pool_fn fn;
+    void *ctx;
+    size_t count;
+    atomic_size_t next;
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    size_t worker;
+} Worker;
+
+static void *pool_worker(void *arg) {
+    Worker *w = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&w->pool->next, 1)) < w->pool->count) {
+        w->pool->fn(w->pool->ctx, i, w->worker);
+    }
+    return NULL;
+}
+
+void parallel_for(size_t count, pool_fn fn, void *ctx, size_t nthreads) {
+    if (count == 0) {
+        return;
+    }
+    Pool pool = { .fn = fn, .ctx = ctx, .count = count };
+    atomic_init(&pool.next, 0);
+    size_t n = nthreads < count ? nthreads : count;
+    if (n == 0) {
+        n = 1;
+    }
+
+    pthread_t *threads = malloc(n * sizeof(pthread_t));
+    Worker *workers = malloc(n * sizeof(Worker));
+    size_t started = 0;
+    for (size_t t = 0; threads != NULL && workers != NULL && t < n; t++) {
+        workers[started] = (Worker) { &pool, started };
+        if (pthread_create(&threads[started], NULL, pool_worker, &workers[started]) == 0) {
+            started++;
+        }
+    }
+    // only the threads that started are joined, with none the caller works
+    if (started == 0) {
+        Worker self = { &pool, 0 };
+        pool_worker(&self);
+    }
+    for (size_t t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    free(workers);
+}
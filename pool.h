@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+
+//
+// Returns the number of online cores, the default worker count.
+//
+size_t pool_default_threads(void);
+
+//
+// Called once for every index, worker being the number below nthreads of
+// the worker running it so callers can keep per-worker state in an array.
+//
+typedef void (*pool_fn)(void *ctx, size_t i, size_t worker);
+
+//
+// Runs fn(ctx, i, worker) for every i below count on up to nthreads
+// worker threads, each claiming the next unclaimed index until none are
+// left, and returns once all are done. If a thread can not be created the
+// workers already running take over its share, and only if none can be
+// created does the caller run fn itself, as worker 0.
+//
+void parallel_for(size_t count, pool_fn fn, void *ctx, size_t nthreads);
@@ -1,17 +1,339 @@
 #include "randstate.h"
 
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 
-gmp_randstate_t state;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define RAND_SSE2 1
+#endif
+
+// splitmix64 finalizer, spreads consecutive seeds into unrelated ones
+static uint64_t mix_seed(uint64_t x) {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+//
+// Mersenne Twister engine: GMP's gmp_randinit_mt, one state per thread.
+//
+
+static _Thread_local gmp_randstate_t mt_state;
+
+static void mt_init(uint64_t seed) {
+    gmp_randinit_mt(mt_state);
+    gmp_randseed_ui(mt_state, seed);
+}
+
+static void mt_init_stream(uint64_t seed, uint64_t stream) {
+    mt_init(mix_seed(seed + stream * 0x9e3779b97f4a7c15));
+}
+
+static void mt_clear(void) {
+    gmp_randclear(mt_state);
+}
+
+static void mt_urandomm(mpz_t r, const mpz_t n) {
+    mpz_urandomm(r, mt_state, n);
+}
+
+static uint64_t mt_urandomm_ui(uint64_t n) {
+    return gmp_urandomm_ui(mt_state, n);
+}
+
+static uint64_t mt_u64(void) {
+    uint64_t hi = gmp_urandomb_ui(mt_state, 32);
+    return hi << 32 | gmp_urandomb_ui(mt_state, 32);
+}
+
+static const RandEngine engine_mt = {
+    "mt",
+    mt_init,
+    mt_init_stream,
+    mt_clear,
+    mt_urandomm,
+    mt_urandomm_ui,
+    mt_u64,
+};
+
+//
+// ChaCha20 engine: the key is expanded from the seed, the nonce selects
+// the stream and the 64-bit block counter runs through it. Blocks are
+// made four at a time into a per-thread buffer that every draw reads.
+//
+
+#define CHACHA_BLOCKS 4
+#define CHACHA_BUF (64 * CHACHA_BLOCKS)
+
+typedef struct {
+    uint32_t input[16];
+    uint8_t buf[CHACHA_BUF];
+    size_t pos;
+} ChaCha;
+
+static _Thread_local ChaCha chacha;
+
+#ifndef RAND_SSE2
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d)                                                                      \
+    a += b, d ^= a, d = ROTL32(d, 16), c += d, b ^= c, b = ROTL32(b, 12);                        \
+    a += b, d ^= a, d = ROTL32(d, 8), c += d, b ^= c, b = ROTL32(b, 7)
+
+// one 64 byte block for the counter in input
+static void chacha_block(const uint32_t input[16], uint8_t *out) {
+    uint32_t x[16];
+    memcpy(x, input, sizeof x);
+    for (int i = 0; i < 10; i++) {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + input[i];
+        out[4 * i] = (uint8_t) v;
+        out[4 * i + 1] = (uint8_t) (v >> 8);
+        out[4 * i + 2] = (uint8_t) (v >> 16);
+        out[4 * i + 3] = (uint8_t) (v >> 24);
+    }
+}
+
+static void chacha_blocks_scalar(uint32_t input[16], uint8_t *out) {
+    for (int b = 0; b < CHACHA_BLOCKS; b++) {
+        chacha_block(input, out + 64 * b);
+        if (++input[12] == 0) {
+            input[13]++;
+        }
+    }
+}
+
+#else
+
+#define ROTV(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+// rotating by 16 swaps the halves of every word, a pair of shuffles
+#define ROTV16(v) _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1)
+
+#define QUARTERV(a, b, c, d)                                                                     \
+    a = _mm_add_epi32(a, b), d = _mm_xor_si128(d, a), d = ROTV16(d);                           \
+    c = _mm_add_epi32(c, d), b = _mm_xor_si128(b, c), b = ROTV(b, 12);                           \
+    a = _mm_add_epi32(a, b), d = _mm_xor_si128(d, a), d = ROTV(d, 8);                            \
+    c = _mm_add_epi32(c, d), b = _mm_xor_si128(b, c), b = ROTV(b, 7)
+
+// four blocks at once, lane j of every word belonging to block j
+static void chacha_blocks_sse2(uint32_t input[16], uint8_t *out) {
+    __m128i x[16], start[16];
+    for (int i = 0; i < 16; i++) {
+        start[i] = _mm_set1_epi32((int) input[i]);
+    }
+    uint64_t c = input[12] | (uint64_t) input[13] << 32;
+    start[12] = _mm_setr_epi32((int) c, (int) (c + 1), (int) (c + 2), (int) (c + 3));
+    start[13] = _mm_setr_epi32((int) (c >> 32), (int) ((c + 1) >> 32), (int) ((c + 2) >> 32),
+        (int) ((c + 3) >> 32));
+    memcpy(x, start, sizeof x);
+
+    for (int i = 0; i < 10; i++) {
+        QUARTERV(x[0], x[4], x[8], x[12]);
+        QUARTERV(x[1], x[5], x[9], x[13]);
+        QUARTERV(x[2], x[6], x[10], x[14]);
+        QUARTERV(x[3], x[7], x[11], x[15]);
+        QUARTERV(x[0], x[5], x[10], x[15]);
+        QUARTERV(x[1], x[6], x[11], x[12]);
+        QUARTERV(x[2], x[7], x[8], x[13]);
+        QUARTERV(x[3], x[4], x[9], x[14]);
+    }
+
+    // transpose groups of four words back into the four blocks
+    for (int i = 0; i < 16; i += 4) {
+        __m128i a = _mm_add_epi32(x[i], start[i]);
+        __m128i b = _mm_add_epi32(x[i + 1], start[i + 1]);
+        __m128i d = _mm_add_epi32(x[i + 2], start[i + 2]);
+        __m128i e = _mm_add_epi32(x[i + 3], start[i + 3]);
+        __m128i ab01 = _mm_unpacklo_epi32(a, b);
+        __m128i de01 = _mm_unpacklo_epi32(d, e);
+        __m128i ab23 = _mm_unpackhi_epi32(a, b);
+        __m128i de23 = _mm_unpackhi_epi32(d, e);
+        _mm_storeu_si128((__m128i *) (out + 4 * i), _mm_unpacklo_epi64(ab01, de01));
+        _mm_storeu_si128((__m128i *) (out + 64 + 4 * i), _mm_unpackhi_epi64(ab01, de01));
+        _mm_storeu_si128((__m128i *) (out + 128 + 4 * i), _mm_unpacklo_epi64(ab23, de23));
+        _mm_storeu_si128((__m128i *) (out + 192 + 4 * i), _mm_unpackhi_epi64(ab23, de23));
+    }
+
+    c += CHACHA_BLOCKS;
+    input[12] = (uint32_t) c;
+    input[13] = (uint32_t) (c >> 32);
+}
+
+#endif
+
+static void chacha_refill(void) {
+#ifdef RAND_SSE2
+    chacha_blocks_sse2(chacha.input, chacha.buf);
+#else
+    chacha_blocks_scalar(chacha.input, chacha.buf);
+#endif
+    chacha.pos = 0;
+}
+
+// copies the next len bytes of the stream into out
+static void chacha_fill(void *out, size_t len) {
+    uint8_t *o = out;
+    while (len > 0) {
+        if (chacha.pos == CHACHA_BUF) {
+            chacha_refill();
+        }
+        size_t n = CHACHA_BUF - chacha.pos < len ? CHACHA_BUF - chacha.pos : len;
+        memcpy(o, chacha.buf + chacha.pos, n);
+        chacha.pos += n;
+        o += n;
+        len -= n;
+    }
+}
+
+static void chacha_init_stream(uint64_t seed, uint64_t stream) {
+    // "expand 32-byte k"
+    static const uint32_t sigma[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+    memcpy(chacha.input, sigma, sizeof sigma);
+    uint64_t s = seed;
+    for (int i = 0; i < 4; i++) {
+        uint64_t k = mix_seed(s);
+        s += 0x9e3779b97f4a7c15;
+        chacha.input[4 + 2 * i] = (uint32_t) k;
+        chacha.input[5 + 2 * i] = (uint32_t) (k >> 32);
+    }
+    chacha.input[12] = 0;
+    chacha.input[13] = 0;
+    chacha.input[14] = (uint32_t) stream;
+    chacha.input[15] = (uint32_t) (stream >> 32);
+    chacha.pos = CHACHA_BUF;
+}
+
+// plain seeding takes the last stream, which no caller counts up to
+static void chacha_init(uint64_t seed) {
+    chacha_init_stream(seed, UINT64_MAX);
+}
+
+static void chacha_clear(void) {
+    memset(&chacha, 0, sizeof chacha);
+}
+
+static uint64_t chacha_u64(void) {
+    uint64_t x;
+    chacha_fill(&x, sizeof x);
+    return x;
+}
+
+// rejection sampling over the bits of n, under two tries on average
+static void chacha_urandomm(mpz_t r, const mpz_t n) {
+    size_t bits = mpz_sizeinbase(n, 2);
+    size_t limbs = (bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+    mp_limb_t top = bits % GMP_NUMB_BITS ? ((mp_limb_t) 1 << bits % GMP_NUMB_BITS) - 1
+                                         : ~(mp_limb_t) 0;
+    do {
+        mp_limb_t *lp = mpz_limbs_write(r, limbs);
+        chacha_fill(lp, limbs * sizeof(mp_limb_t));
+        lp[limbs - 1] &= top;
+        mpz_limbs_finish(r, limbs);
+    } while (mpz_cmp(r, n) >= 0);
+}
+
+static uint64_t chacha_urandomm_ui(uint64_t n) {
+    // values below 2^64 mod n would make the low residues more likely
+    uint64_t floor = -n % n;
+    uint64_t x;
+    do {
+        x = chacha_u64();
+    } while (x < floor);
+    return x % n;
+}
+
+static const RandEngine engine_chacha = {
+    "chacha",
+    chacha_init,
+    chacha_init_stream,
+    chacha_clear,
+    chacha_urandomm,
+    chacha_urandomm_ui,
+    chacha_u64,
+};
+
+//
+// Engine selection
+//
+
+static const RandEngine *engines[] = { &engine_mt, &engine_chacha };
+
+static const RandEngine *engine = NULL;
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+
+static const RandEngine *engine_find(const char *name) {
+    for (size_t i = 0; i < sizeof engines / sizeof engines[0]; i++) {
+        if (strcmp(name, engines[i]->name) == 0) {
+            return engines[i];
+        }
+    }
+    return NULL;
+}
+
+static void engine_init(void) {
+    if (engine != NULL) {
+        return;
+    }
+    const char *name = getenv("SS_RNG");
+    if (name != NULL) {
+        engine = engine_find(name);
+    }
+    if (engine == NULL) {
+        engine = &engine_mt;
+    }
+}
+
+bool randstate_select(const char *name) {
+    const RandEngine *e = engine_find(name);
+    if (e == NULL) {
+        return false;
+    }
+    engine = e;
+    return true;
+}
+
+const RandEngine *randstate_engine(void) {
+    pthread_once(&engine_once, engine_init);
+    return engine;
+}
 
 //initializes random usage
 void randstate_init(uint64_t seed) {
-    srandom(seed);
-    gmp_randinit_mt(state);
-    gmp_randseed_ui(state, seed);
+    randstate_engine()->init(seed);
+}
+
+//initializes one of the independent streams of seed
+void randstate_init_stream(uint64_t seed, uint64_t stream) {
+    randstate_engine()->init_stream(seed, stream);
 }
 
 //clears all memory used by state
 void randstate_clear() {
-    gmp_randclear(state);
+    randstate_engine()->clear();
+}
+
+void rand_urandomm(mpz_t r, const mpz_t n) {
+    engine->urandomm(r, n);
+}
+
+uint64_t rand_urandomm_ui(uint64_t n) {
+    return engine->urandomm_ui(n);
+}
+
+uint64_t rand_u64(void) {
+    return engine->u64();
 }
@@ -2,20 +2,81 @@
 
 #include <stdio.h>
 #include <gmp.h>
+#include <stdbool.h>
 #include <stdint.h>
 
-extern gmp_randstate_t state;
+//
+// Random engine: one generator behind every draw made through randstate.
+//
+// name: name used to select the engine
+//
+typedef struct {
+    const char *name;
+    void (*init)(uint64_t seed);
+    void (*init_stream)(uint64_t seed, uint64_t stream);
+    void (*clear)(void);
+    void (*urandomm)(mpz_t r, const mpz_t n);
+    uint64_t (*urandomm_ui)(uint64_t n);
+    uint64_t (*u64)(void);
+} RandEngine;
+
+//
+// Selects the engine used by every thread's random state.
+// Must be called before any thread calls randstate_init.
+//
+// Without a call the SS_RNG environment variable picks the engine,
+// falling back to mt.
+//
+// name: "mt" (GMP's Mersenne Twister) or "chacha" (buffered ChaCha20)
+//
+// Returns false if name is not a known engine.
+//
+bool randstate_select(const char *name);
+
+//
+// Returns the engine in use.
+//
+const RandEngine *randstate_engine(void);
 
 //
 // Initializes the random state needed for SS key generation operations.
-// Must be called before any key generation or number theory operations are used.
+// Must be called before any key generation or number theory operations are used,
+// once in every thread that uses them.
 //
 // seed: the seed to seed the random state with.
 //
 void randstate_init(uint64_t seed);
 
+//
+// Initializes the random state as stream number stream of seed, one of
+// many independent streams with the same seed, e.g. one per thread or
+// per key. Stream 0 is not the stream randstate_init gives.
+//
+// seed: the seed shared by all the streams.
+// stream: index of this stream.
+//
+void randstate_init_stream(uint64_t seed, uint64_t stream);
+
 //
 // Frees any memory used by the initialized random state.
-// Must be called after all key generation or number theory operations are used.
+// Must be called after all key generation or number theory operations are used,
+// by every thread that called randstate_init.
 //
 void randstate_clear(void);
+
+//
+// Draws from the calling thread's random state, which must be initialized.
+//
+// Sets r to a uniformly random integer in [0, n), n > 0.
+//
+void rand_urandomm(mpz_t r, const mpz_t n);
+
+//
+// Returns a uniformly random integer in [0, n), n > 0.
+//
+uint64_t rand_urandomm_ui(uint64_t n);
+
+//
+// Returns 64 random bits.
+//
+uint64_t rand_u64(void);
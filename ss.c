@@ -1,11 +1,17 @@
 #include "ss.h"
 #include "numtheory.h"
 #include "randstate.h"
+#include "hexio.h"
+#include "lz.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <inttypes.h>
+#include <pthread.h>
+
+// First line of ciphertext whose plaintext went through lz_compress
+#define LZ_HEADER "#lz\n"
 
 // Generates the components for a new SS key.
 //
@@ -26,7 +32,7 @@ void ss_make_pub(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters) {
     // choose number of bits for p and q
     uint64_t low = nbits / 5;
     uint64_t up = ((2 * nbits) / 5) - low;
-    uint64_t pbits = (rand() % up) + low;
+    uint64_t pbits = rand_urandomm_ui(up) + low;
     uint64_t qbits = nbits - (2 * pbits);
 
     //add one to make n at least nbits
@@ -101,7 +107,10 @@ void ss_make_priv(mpz_t d, mpz_t pq, const mpz_t p, const mpz_t q) {
 //
 void ss_write_pub(const mpz_t n, const char username[], FILE *pbfile) {
     // print n into file
-    gmp_fprintf(pbfile, "%Zx\n", n);
+    HexBuf hb;
+    hexbuf_init(&hb);
+    hex_write(pbfile, n, &hb);
+    hexbuf_clear(&hb);
 
     // Allocate space for username and print it
     size_t len = LOGIN_NAME_MAX + 1;
@@ -121,8 +130,30 @@ void ss_write_pub(const mpz_t n, const char username[], FILE *pbfile) {
 //  pvfile: open and writable file stream
 //
 void ss_write_priv(const mpz_t pq, const mpz_t d, FILE *pvfile) {
-    gmp_fprintf(pvfile, "%Zx\n", pq);
-    gmp_fprintf(pvfile, "%Zx\n", d);
+    HexBuf hb;
+    hexbuf_init(&hb);
+    hex_write(pvfile, pq, &hb);
+    hex_write(pvfile, d, &hb);
+    hexbuf_clear(&hb);
+    return;
+}
+
+//
+// Export the prime factors of pq to the private key stream
+//
+// Written after ss_write_priv, older readers stop before them.
+//
+// Requires:
+//  p:  first prime
+//  q: second prime
+//  pvfile: open and writable file stream
+//
+void ss_write_priv_factors(const mpz_t p, const mpz_t q, FILE *pvfile) {
+    HexBuf hb;
+    hexbuf_init(&hb);
+    hex_write(pvfile, p, &hb);
+    hex_write(pvfile, q, &hb);
+    hexbuf_clear(&hb);
     return;
 }
 
@@ -133,15 +164,22 @@ void ss_write_priv(const mpz_t pq, const mpz_t d, FILE *pvfile) {
 //  n: public modulus
 //  username: $USER of the pubkey creator
 //
+// Returns false if pbfile does not start with a hex modulus.
+//
 // Requires:
 //  pbfile: open and readable file stream
 //  username: requires sufficient space
 //  all mpz_t arguments to be initialized
 //
-void ss_read_pub(mpz_t n, char username[], FILE *pbfile) {
-    gmp_fscanf(pbfile, "%Zx\n", n);
-    fscanf(pbfile, "%s\n", username);
-    return;
+bool ss_read_pub(mpz_t n, char username[], FILE *pbfile) {
+    HexBuf hb;
+    hexbuf_init(&hb);
+    bool ok = hex_read(pbfile, n, &hb);
+    hexbuf_clear(&hb);
+    if (fscanf(pbfile, "%s\n", username) != 1) {
+        username[0] = '\0';
+    }
+    return ok;
 }
 
 //
@@ -156,11 +194,45 @@ void ss_read_pub(mpz_t n, char username[], FILE *pbfile) {
 //  all mpz_t arguments to be initialized
 //
 void ss_read_priv(mpz_t pq, mpz_t d, FILE *pvfile) {
-    gmp_fscanf(pvfile, "%Zx\n", pq);
-    gmp_fscanf(pvfile, "%Zx\n", d);
+    HexBuf hb;
+    hexbuf_init(&hb);
+    hex_read(pvfile, pq, &hb);
+    hex_read(pvfile, d, &hb);
+    hexbuf_clear(&hb);
     return;
 }
 
+//
+// Import the prime factors of pq from the private key stream
+//
+// Provides:
+//  p:  first prime
+//  q: second prime
+//
+// Returns false if the key has no factors or they do not multiply to pq,
+// in which case p and q are unspecified.
+//
+// Requires:
+//  pq: private modulus read by ss_read_priv
+//  pvfile: open and readable file stream, positioned after ss_read_priv
+//  all mpz_t arguments to be initialized
+//
+bool ss_read_priv_factors(mpz_t p, mpz_t q, const mpz_t pq, FILE *pvfile) {
+    HexBuf hb;
+    hexbuf_init(&hb);
+    bool ok = hex_read(pvfile, p, &hb) && hex_read(pvfile, q, &hb);
+    hexbuf_clear(&hb);
+    if (!ok) {
+        return false;
+    }
+    mpz_t t;
+    mpz_init(t);
+    mpz_mul(t, p, q);
+    ok = mpz_cmp(t, pq) == 0;
+    mpz_clear(t);
+    return ok;
+}
+
 //
 // Encrypt number m into number c
 //
@@ -176,6 +248,207 @@ void ss_encrypt(mpz_t c, const mpz_t m, const mpz_t n) {
     pow_mod(c, m, n, n);
     return;
 }
+//
+// Number of plaintext bytes that fit into one block under modulus n.
+// Every block is prefixed with a 0xFF byte so leading zeros survive.
+//
+static uint64_t block_size(const mpz_t n) {
+    //calculate block size k
+    uint64_t k = ((mpz_sizeinbase(n, 2) / 2) - 1) / 8;
+    return k > 2 ? k - 2 : 0;
+}
+
+//
+// Per-thread scratch state
+//
+void ss_scratch_init(SSScratch *scratch) {
+    mpz_inits(scratch->m, scratch->c, NULL);
+    hexbuf_init(&scratch->hb);
+    scratch->block = NULL;
+    scratch->block_cap = 0;
+    scratch->data = NULL;
+    scratch->data_cap = 0;
+    scratch->cache = NULL;
+    scratch->cache_hits = 0;
+    scratch->cache_misses = 0;
+}
+
+void ss_scratch_clear(SSScratch *scratch) {
+    mpz_clears(scratch->m, scratch->c, NULL);
+    hexbuf_clear(&scratch->hb);
+    free(scratch->block);
+    free(scratch->data);
+    ss_scratch_cache(scratch, 0);
+}
+
+// One remembered block and the ciphertext line it encrypts to
+typedef struct {
+    bool used;
+    uint64_t hash;
+    uint8_t *block;
+    size_t len;
+    char *line;
+    size_t line_len;
+} CacheSlot;
+
+// Direct mapped, a new block evicts whatever shared its slot
+struct SSBlockCache {
+    mpz_t n;
+    size_t mask;
+    CacheSlot *slots;
+    CacheSlot *last;
+};
+
+//
+// Remember the ciphertext of up to entries plaintext blocks, false if the
+// table can not be allocated
+//
+bool ss_scratch_cache(SSScratch *scratch, size_t entries) {
+    SSBlockCache *cache = scratch->cache;
+    if (entries > SS_CACHE_MAX) {
+        entries = SS_CACHE_MAX;
+    }
+    size_t slots = 1;
+    while (slots < entries) {
+        slots <<= 1;
+    }
+    if (cache != NULL && (entries == 0 || cache->mask != slots - 1)) {
+        for (size_t i = 0; i <= cache->mask; i++) {
+            free(cache->slots[i].block);
+            free(cache->slots[i].line);
+        }
+        free(cache->slots);
+        mpz_clear(cache->n);
+        free(cache);
+        scratch->cache = cache = NULL;
+    }
+    if (cache == NULL && entries > 0) {
+        CacheSlot *table = calloc(slots, sizeof *table);
+        cache = malloc(sizeof *cache);
+        if (table == NULL || cache == NULL) {
+            free(table);
+            free(cache);
+            return false;
+        }
+        mpz_init(cache->n);
+        cache->mask = slots - 1;
+        cache->slots = table;
+        cache->last = NULL;
+        scratch->cache = cache;
+    }
+    return true;
+}
+
+// word at a time multiplicative hash of a block
+static uint64_t block_hash(const uint8_t *block, size_t len) {
+    uint64_t h = len * 0x9e3779b97f4a7c15;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, block + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccd;
+        h ^= h >> 32;
+    }
+    for (; i < len; i++) {
+        h = (h ^ block[i]) * 0x100000001b3;
+    }
+    return h ^ (h >> 29);
+}
+
+static bool slot_holds(const CacheSlot *slot, const uint8_t *block, size_t len) {
+    return slot->used && slot->len == len && memcmp(slot->block, block, len) == 0;
+}
+
+// finds the slot already holding block, or NULL after pointing *miss at
+// the slot it should go into
+static CacheSlot *cache_find(
+    SSBlockCache *cache, const mpz_t n, const uint8_t *block, size_t len, CacheSlot **miss) {
+    if (mpz_cmp(cache->n, n) != 0) {
+        for (size_t i = 0; i <= cache->mask; i++) {
+            cache->slots[i].used = false;
+        }
+        cache->last = NULL;
+        mpz_set(cache->n, n);
+    }
+    // a run of identical blocks skips even the hash
+    if (cache->last != NULL && slot_holds(cache->last, block, len)) {
+        return cache->last;
+    }
+    uint64_t h = block_hash(block, len);
+    CacheSlot *slot = &cache->slots[h & cache->mask];
+    if (slot->hash == h && slot_holds(slot, block, len)) {
+        return cache->last = slot;
+    }
+    slot->hash = h;
+    *miss = slot;
+    return NULL;
+}
+
+// stores block and its line in slot. If the buffers can not grow the slot
+// is left unused, keeping the buffers it has, and false is returned.
+static bool cache_fill(CacheSlot *slot, const uint8_t *block, size_t len, const char *line,
+    size_t line_len) {
+    slot->used = false;
+    uint8_t *b = realloc(slot->block, len ? len : 1);
+    if (b == NULL) {
+        return false;
+    }
+    slot->block = b;
+    char *l = realloc(slot->line, line_len);
+    if (l == NULL) {
+        return false;
+    }
+    slot->line = l;
+    memcpy(slot->block, block, len);
+    slot->len = len;
+    memcpy(slot->line, line, line_len);
+    slot->line_len = line_len;
+    slot->used = true;
+    return true;
+}
+
+// grows one of the scratch buffers to hold at least need bytes
+static uint8_t *reserve(uint8_t **buf, size_t *cap, size_t need) {
+    if (*cap < need) {
+        *cap = need > 2 * *cap ? need : 2 * *cap;
+        *buf = realloc(*buf, *cap);
+    }
+    return *buf;
+}
+
+//
+// Encrypt len bytes of block and print the ciphertext as a hex line
+//
+static void encrypt_block(
+    FILE *outfile, const uint8_t *block, size_t len, const mpz_t n, SSScratch *scratch) {
+    SSBlockCache *cache = scratch->cache;
+    CacheSlot *slot = NULL;
+    if (cache != NULL) {
+        CacheSlot *hit = cache_find(cache, n, block, len, &slot);
+        if (hit != NULL) {
+            scratch->cache_hits++;
+            fwrite(hit->line, 1, hit->line_len, outfile);
+            return;
+        }
+        scratch->cache_misses++;
+    }
+
+    mpz_import(scratch->m, len, 1, sizeof(block[0]), 1, 0, block);
+    // prepend the 0xFF marker byte
+    for (size_t b = 0; b < 8; b++) {
+        mpz_setbit(scratch->m, 8 * len + b);
+    }
+    // encrypt block of text
+    ss_encrypt(scratch->c, scratch->m, n);
+    // print it into outfile
+    size_t line_len;
+    const char *line = hex_format(scratch->c, &scratch->hb, &line_len);
+    fwrite(line, 1, line_len, outfile);
+    if (slot != NULL && cache_fill(slot, block, len, line, line_len)) {
+        cache->last = slot;
+    }
+}
+
 //
 // Encrypt an arbitrary file
 //
@@ -188,31 +461,154 @@ void ss_encrypt(mpz_t c, const mpz_t m, const mpz_t n) {
 //  n: public exponent and modulus
 //
 void ss_encrypt_file(FILE *infile, FILE *outfile, const mpz_t n) {
-    mpz_t m, c;
-    mpz_inits(m, c, NULL);
+    SSScratch scratch;
+    ss_scratch_init(&scratch);
+    ss_encrypt_file_r(infile, outfile, n, &scratch);
+    ss_scratch_clear(&scratch);
+}
 
-    //calculate block size k
-    uint64_t k = ((mpz_sizeinbase(n, 2) / 2) - 1) / 8;
-    uint8_t *kbytes = malloc(k * sizeof(uint8_t));
-    memset(kbytes, 0, k);
-    kbytes[0] = 0xFF;
-
-    while (fread(kbytes + 1, sizeof *kbytes, k - 2, infile) > 0) {
-        // j is number of read bytes
-        uint64_t j = (uint64_t) strlen((const char *) kbytes);
-        mpz_import(m, j, 1, sizeof(kbytes[0]), 1, 0, kbytes);
-        // encrypt block of text
-        ss_encrypt(c, m, n);
-        // print it into outfile
-        gmp_fprintf(outfile, "%Zx\n", c);
-        // clear array
-        memset(kbytes, 0, j);
-        kbytes[0] = 0xFF;
+void ss_encrypt_file_r(FILE *infile, FILE *outfile, const mpz_t n, SSScratch *scratch) {
+    uint64_t k = block_size(n);
+    uint8_t *kbytes = reserve(&scratch->block, &scratch->block_cap, k + 1);
+    size_t j;
+
+    // j is number of read bytes
+    while (k > 0 && (j = fread(kbytes, sizeof *kbytes, k, infile)) > 0) {
+        encrypt_block(outfile, kbytes, j, n, scratch);
     }
+}
+
+//
+// Encrypt a buffer already held in memory
+//
+// Provides:
+//  fills outfile with the encrypted contents of buf, identical to what
+//  ss_encrypt_file writes for the same bytes
+//
+// Requires:
+//  buf: len readable bytes, only read so it may be shared between threads
+//  outfile: open and writable file stream
+//  n: public exponent and modulus
+//
+void ss_encrypt_buffer(const uint8_t *buf, size_t len, FILE *outfile, const mpz_t n) {
+    SSScratch scratch;
+    ss_scratch_init(&scratch);
+    ss_encrypt_buffer_r(buf, len, outfile, n, &scratch);
+    ss_scratch_clear(&scratch);
+}
 
-    free(kbytes);
-    mpz_clears(m, c, NULL);
+void ss_encrypt_buffer_r(
+    const uint8_t *buf, size_t len, FILE *outfile, const mpz_t n, SSScratch *scratch) {
+    uint64_t k = block_size(n);
+    for (size_t i = 0; k > 0 && i < len; i += k) {
+        size_t j = len - i < k ? len - i : k;
+        encrypt_block(outfile, buf + i, j, n, scratch);
+    }
 }
+
+//
+// Encrypt a buffer holding lz_compress output
+//
+// Provides:
+//  fills outfile with a header flagging the data as compressed, followed
+//  by the encrypted contents of lzbuf
+//
+// Requires:
+//  lzbuf: lzlen bytes written by lz_compress
+//  outfile: open and writable file stream
+//  n: public exponent and modulus
+//
+void ss_encrypt_lz(const uint8_t *lzbuf, size_t lzlen, FILE *outfile, const mpz_t n) {
+    SSScratch scratch;
+    ss_scratch_init(&scratch);
+    ss_encrypt_lz_r(lzbuf, lzlen, outfile, n, &scratch);
+    ss_scratch_clear(&scratch);
+}
+
+void ss_encrypt_lz_r(
+    const uint8_t *lzbuf, size_t lzlen, FILE *outfile, const mpz_t n, SSScratch *scratch) {
+    fputs(LZ_HEADER, outfile);
+    ss_encrypt_buffer_r(lzbuf, lzlen, outfile, n, scratch);
+}
+
+//
+// Fingerprint of public key n, FNV-1a over its bytes
+//
+uint64_t ss_fingerprint(const mpz_t n) {
+    size_t len;
+    uint8_t *bytes = mpz_export(NULL, &len, 1, 1, 1, 0, n);
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ bytes[i]) * 0x100000001b3;
+    }
+    free(bytes);
+    return h;
+}
+
+//
+// Export append state to output stream
+//
+// Requires:
+//  st: state left by ss_encrypt_append
+//  stfile: open and writable file stream
+//
+void ss_write_append_state(const SSAppendState *st, FILE *stfile) {
+    fprintf(stfile, "%016" PRIx64 "\n", st->key);
+    fprintf(stfile, "%" PRIu64 "\n", st->in_off);
+    fprintf(stfile, "%" PRIu64 "\n", st->out_off);
+    fprintf(stfile, "%" PRIu64 "\n", st->partial);
+}
+
+//
+// Import append state from input stream
+//
+// Returns false if stfile does not hold a complete state.
+//
+// Requires:
+//  stfile: open and readable file stream
+//
+bool ss_read_append_state(SSAppendState *st, FILE *stfile) {
+    return fscanf(stfile, "%" SCNx64 " %" SCNu64 " %" SCNu64 " %" SCNu64, &st->key,
+               &st->in_off, &st->out_off, &st->partial)
+           == 4;
+}
+
+//
+// Encrypt the bytes appended to a file since the last call
+//
+// Provides:
+//  appends the encrypted contents of infile to outfile, the same blocks
+//  ss_encrypt_file would give for the whole input. st is advanced past
+//  every complete block, a short final block is written but left to be
+//  encrypted again once the input has grown.
+//
+// Requires:
+//  infile: open and readable file stream positioned at st->in_off
+//  outfile: open and writable file stream positioned at st->out_off
+//  n: public exponent and modulus
+//  st: state from the previous call, or zeroed with key set for a new file
+//
+void ss_encrypt_append(FILE *infile, FILE *outfile, const mpz_t n, SSAppendState *st) {
+    SSScratch scratch;
+    ss_scratch_init(&scratch);
+    uint64_t k = block_size(n);
+    uint8_t *kbytes = reserve(&scratch.block, &scratch.block_cap, k + 1);
+    size_t j;
+
+    st->partial = 0;
+    while (k > 0 && (j = fread(kbytes, sizeof *kbytes, k, infile)) > 0) {
+        encrypt_block(outfile, kbytes, j, n, &scratch);
+        if (j < k) {
+            // short block, redone from in_off next time
+            st->partial = j;
+            break;
+        }
+        st->in_off += k;
+        st->out_off = ftello(outfile);
+    }
+    ss_scratch_clear(&scratch);
+}
+
 //
 // Decrypt number c into number m
 //
@@ -230,11 +626,92 @@ void ss_decrypt(mpz_t m, const mpz_t c, const mpz_t d, const mpz_t pq) {
     return;
 }
 
+//
+// Consume the LZ header if infile starts with one
+//
+static bool read_lz_header(FILE *infile) {
+    int ch = fgetc(infile);
+    if (ch != '#') {
+        if (ch != EOF) {
+            ungetc(ch, infile);
+        }
+        return false;
+    }
+    char line[16];
+    if (fgets(line, sizeof line, infile) == NULL) {
+        return false;
+    }
+    return strcmp(line, LZ_HEADER + 1) == 0;
+}
+
+// Decrypts one block, ctx holding the key in whatever form fn needs
+typedef void (*decrypt_fn)(mpz_t m, const mpz_t c, const void *ctx);
+
+//
+// Decrypt every block of infile with fn, k being the block size in bytes
+//
+static bool decrypt_stream(FILE *infile, FILE *outfile, uint64_t k, decrypt_fn fn,
+    const void *ctx, SSScratch *scratch) {
+    size_t j;
+    bool ok = true;
+
+    // m < pq, so one byte past k always fits a block
+    uint8_t *kbytes = reserve(&scratch->block, &scratch->block_cap, k + 1);
+
+    // compressed plaintext is gathered and expanded once all blocks are in
+    bool compressed = read_lz_header(infile);
+    size_t plain_len = 0;
+
+    while (hex_read(infile, scratch->c, &scratch->hb)) {
+        // decrypt scanned line
+        fn(scratch->m, scratch->c, ctx);
+
+        // j = number of read bytes
+        mpz_export(kbytes, &j, 1, sizeof(unsigned char), 1, 0, scratch->m);
+        if (j < 1) {
+            continue;
+        }
+
+        // print out read bytes from m, skipping the 0xFF marker
+        if (!compressed) {
+            fwrite(kbytes + 1, sizeof(uint8_t), j - 1, outfile);
+            continue;
+        }
+        uint8_t *plain = reserve(&scratch->data, &scratch->data_cap, plain_len + j);
+        memcpy(plain + plain_len, kbytes + 1, j - 1);
+        plain_len += j - 1;
+    }
+
+    if (compressed) {
+        size_t len;
+        uint8_t *out = lz_decompress(scratch->data, plain_len, &len);
+        if (out != NULL) {
+            fwrite(out, sizeof(uint8_t), len, outfile);
+        }
+        ok = out != NULL;
+        free(out);
+    }
+    return ok;
+}
+
+typedef struct {
+    mpz_srcptr d;
+    mpz_srcptr pq;
+} PlainKey;
+
+static void decrypt_plain(mpz_t m, const mpz_t c, const void *ctx) {
+    const PlainKey *key = ctx;
+    ss_decrypt(m, c, key->d, key->pq);
+}
+
 //
 // Decrypt a file back into its original form.
 //
 // Provides:
-//  fills outfile with the unencrypted data from infile
+//  fills outfile with the unencrypted data from infile, expanding it if
+//  it was encrypted with ss_encrypt_lz
+//
+// Returns false if compressed data turned out to be corrupt.
 //
 // Requires:
 //  infile: open and readable file stream to encrypted data
@@ -242,30 +719,150 @@ void ss_decrypt(mpz_t m, const mpz_t c, const mpz_t d, const mpz_t pq) {
 //  d: private exponent
 //  pq: private modulus
 //
-void ss_decrypt_file(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t pq) {
-    mpz_t m, c, i;
-    mpz_inits(m, c, i, NULL);
-    size_t j;
+bool ss_decrypt_file(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t pq) {
+    SSScratch scratch;
+    ss_scratch_init(&scratch);
+    bool ok = ss_decrypt_file_r(infile, outfile, d, pq, &scratch);
+    ss_scratch_clear(&scratch);
+    return ok;
+}
 
+bool ss_decrypt_file_r(
+    FILE *infile, FILE *outfile, const mpz_t d, const mpz_t pq, SSScratch *scratch) {
+    PlainKey key = { d, pq };
     //calculate block size k
     uint64_t k = ((mpz_sizeinbase(pq, 2) - 1) / 8);
+    return decrypt_stream(infile, outfile, k, decrypt_plain, &key, scratch);
+}
 
-    uint8_t *kbytes = malloc(k * sizeof(uint8_t));
+//
+// Private key split for the Chinese remainder theorem: the exponents
+// reduced mod p - 1 and q - 1 and the inverse of q mod p
+//
+typedef struct {
+    mpz_t p, q, dp, dq, qinv;
+    bool parallel;
+} CrtKey;
 
-    while (gmp_fscanf(infile, "%Zx", c) == 1) {
-        // decrypt scanned line
-        ss_decrypt(m, c, d, pq);
+static void crt_init(CrtKey *key, const mpz_t d, const mpz_t p, const mpz_t q, bool parallel) {
+    mpz_inits(key->p, key->q, key->dp, key->dq, key->qinv, NULL);
+    mpz_set(key->p, p);
+    mpz_set(key->q, q);
+    mpz_sub_ui(key->dp, p, 1);
+    mpz_mod(key->dp, d, key->dp);
+    mpz_sub_ui(key->dq, q, 1);
+    mpz_mod(key->dq, d, key->dq);
+    mod_inverse(key->qinv, q, p);
+    key->parallel = parallel;
+}
 
-        memset(kbytes, 0, k);
-        // j = number of read bytes
-        mpz_export(kbytes, &j, 1, sizeof(unsigned char), 1, 0, m);
+static void crt_clear(CrtKey *key) {
+    mpz_clears(key->p, key->q, key->dp, key->dq, key->qinv, NULL);
+}
 
-        for (uint64_t i = 1; i < j; i++) {
-            // print out read bytes from m
-            fprintf(outfile, "%c", kbytes[i]);
-        }
+// One half of a CRT decryption: o = c^e mod prime
+typedef struct {
+    mpz_ptr o;
+    mpz_srcptr c;
+    mpz_srcptr e;
+    mpz_srcptr prime;
+} CrtHalf;
+
+static void *crt_half(void *arg) {
+    CrtHalf *h = arg;
+    mpz_mod(h->o, h->c, h->prime);
+    // c^e mod prime would give 1 for c = 0 mod prime and e = 0
+    if (mpz_sgn(h->o) != 0) {
+        pow_mod(h->o, h->o, h->e, h->prime);
     }
+    return NULL;
+}
+
+static void decrypt_crt(mpz_t m, const mpz_t c, const void *ctx) {
+    const CrtKey *key = ctx;
+    // m may be c, so it is only written once both halves have read c
+    mpz_t mp, mq;
+    mpz_inits(mp, mq, NULL);
+    CrtHalf hp = { mp, c, key->dp, key->p };
+    CrtHalf hq = { mq, c, key->dq, key->q };
 
-    free(kbytes);
-    mpz_clears(m, c, i, NULL);
+    // the mod q half runs on its own thread while this one does mod p
+    pthread_t thread;
+    bool threaded = key->parallel && pthread_create(&thread, NULL, crt_half, &hq) == 0;
+    crt_half(&hp);
+    if (threaded) {
+        pthread_join(thread, NULL);
+    } else {
+        crt_half(&hq);
+    }
+
+    // m = mq + q * ((mp - mq) * qinv mod p)
+    mpz_sub(m, mp, mq);
+    mpz_mul(m, m, key->qinv);
+    mpz_mod(m, m, key->p);
+    mpz_mul(m, m, key->q);
+    mpz_add(m, m, mq);
+    mpz_clears(mp, mq, NULL);
+}
+
+//
+// Decrypt number c into number m using the factors of pq
+//
+// Provides:
+//  m: decrypted/original integer, the same as ss_decrypt gives
+//
+// Requires:
+//  c: encrypted integer
+//  d: private exponent
+//  p:  first prime
+//  q: second prime
+//  parallel: compute the mod p and mod q halves on two threads
+//  all mpz_t arguments to be initialized
+//
+void ss_decrypt_crt(
+    mpz_t m, const mpz_t c, const mpz_t d, const mpz_t p, const mpz_t q, bool parallel) {
+    CrtKey key;
+    crt_init(&key, d, p, q, parallel);
+    decrypt_crt(m, c, &key);
+    crt_clear(&key);
+}
+
+//
+// Decrypt a file back into its original form using the factors of pq
+//
+// Provides:
+//  fills outfile with the same data ss_decrypt_file gives
+//
+// Returns false if compressed data turned out to be corrupt.
+//
+// Requires:
+//  infile: open and readable file stream to encrypted data
+//  outfile: open and writable file stream
+//  d: private exponent
+//  p:  first prime
+//  q: second prime
+//  parallel: compute the mod p and mod q halves of each block on two threads
+//
+bool ss_decrypt_file_crt(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t p,
+    const mpz_t q, bool parallel) {
+    SSScratch scratch;
+    ss_scratch_init(&scratch);
+    bool ok = ss_decrypt_file_crt_r(infile, outfile, d, p, q, parallel, &scratch);
+    ss_scratch_clear(&scratch);
+    return ok;
+}
+
+bool ss_decrypt_file_crt_r(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t p,
+    const mpz_t q, bool parallel, SSScratch *scratch) {
+    CrtKey key;
+    crt_init(&key, d, p, q, parallel);
+    mpz_t pq;
+    mpz_init(pq);
+    mpz_mul(pq, p, q);
+    //calculate block size k
+    uint64_t k = ((mpz_sizeinbase(pq, 2) - 1) / 8);
+    bool ok = decrypt_stream(infile, outfile, k, decrypt_crt, &key, scratch);
+    mpz_clear(pq);
+    crt_clear(&key);
+    return ok;
 }
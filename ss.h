@@ -5,6 +5,44 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "hexio.h"
+
+//
+// Scratch state for the file and buffer functions. The _r variants take
+// one explicitly so that a thread handling many files reuses the same
+// integers and buffers, the plain versions make a fresh one per call.
+//
+typedef struct SSBlockCache SSBlockCache;
+
+typedef struct {
+    mpz_t m, c;
+    HexBuf hb;
+    uint8_t *block;
+    size_t block_cap;
+    uint8_t *data;
+    size_t data_cap;
+    SSBlockCache *cache;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+} SSScratch;
+
+void ss_scratch_init(SSScratch *scratch);
+
+void ss_scratch_clear(SSScratch *scratch);
+
+//
+// Remember the ciphertext of up to entries plaintext blocks encrypted
+// with scratch, so a repeated block is written without exponentiating it
+// again. Lookups are counted in cache_hits and cache_misses, the cache is
+// emptied whenever the key changes and entries of 0 disables it.
+// entries is capped at SS_CACHE_MAX.
+//
+// Returns false, leaving the cache disabled, if it can not be allocated.
+//
+#define SS_CACHE_MAX ((size_t) 1 << 20)
+
+bool ss_scratch_cache(SSScratch *scratch, size_t entries);
+
 //
 // Generates the components for a new SS key.
 //
@@ -54,6 +92,18 @@ void ss_write_pub(const mpz_t n, const char username[], FILE *pbfile);
 //
 void ss_write_priv(const mpz_t pq, const mpz_t d, FILE *pvfile);
 
+//
+// Export the prime factors of pq to the private key stream
+//
+// Written after ss_write_priv, older readers stop before them.
+//
+// Requires:
+//  p:  first prime
+//  q: second prime
+//  pvfile: open and writable file stream
+//
+void ss_write_priv_factors(const mpz_t p, const mpz_t q, FILE *pvfile);
+
 //
 // Import SS public key from input stream
 //
@@ -61,12 +111,14 @@ void ss_write_priv(const mpz_t pq, const mpz_t d, FILE *pvfile);
 //  n: public modulus
 //  username: $USER of the pubkey creator
 //
+// Returns false if pbfile does not start with a hex modulus.
+//
 // Requires:
 //  pbfile: open and readable file stream
 //  username: requires sufficient space
 //  all mpz_t arguments to be initialized
 //
-void ss_read_pub(mpz_t n, char username[], FILE *pbfile);
+bool ss_read_pub(mpz_t n, char username[], FILE *pbfile);
 
 //
 // Import SS private key from input stream
@@ -81,6 +133,23 @@ void ss_read_pub(mpz_t n, char username[], FILE *pbfile);
 //
 void ss_read_priv(mpz_t pq, mpz_t d, FILE *pvfile);
 
+//
+// Import the prime factors of pq from the private key stream
+//
+// Provides:
+//  p:  first prime
+//  q: second prime
+//
+// Returns false if the key has no factors or they do not multiply to pq,
+// in which case p and q are unspecified.
+//
+// Requires:
+//  pq: private modulus read by ss_read_priv
+//  pvfile: open and readable file stream, positioned after ss_read_priv
+//  all mpz_t arguments to be initialized
+//
+bool ss_read_priv_factors(mpz_t p, mpz_t q, const mpz_t pq, FILE *pvfile);
+
 //
 // Encrypt number m into number c
 //
@@ -107,6 +176,94 @@ void ss_encrypt(mpz_t c, const mpz_t m, const mpz_t n);
 //
 void ss_encrypt_file(FILE *infile, FILE *outfile, const mpz_t n);
 
+void ss_encrypt_file_r(FILE *infile, FILE *outfile, const mpz_t n, SSScratch *scratch);
+
+//
+// Encrypt a buffer already held in memory
+//
+// Provides:
+//  fills outfile with the encrypted contents of buf, identical to what
+//  ss_encrypt_file writes for the same bytes
+//
+// Requires:
+//  buf: len readable bytes, only read so it may be shared between threads
+//  outfile: open and writable file stream
+//  n: public exponent and modulus
+//
+void ss_encrypt_buffer(const uint8_t *buf, size_t len, FILE *outfile, const mpz_t n);
+
+void ss_encrypt_buffer_r(
+    const uint8_t *buf, size_t len, FILE *outfile, const mpz_t n, SSScratch *scratch);
+
+//
+// Encrypt a buffer holding lz_compress output
+//
+// Provides:
+//  fills outfile with a header flagging the data as compressed, followed
+//  by the encrypted contents of lzbuf
+//
+// Requires:
+//  lzbuf: lzlen bytes written by lz_compress
+//  outfile: open and writable file stream
+//  n: public exponent and modulus
+//
+void ss_encrypt_lz(const uint8_t *lzbuf, size_t lzlen, FILE *outfile, const mpz_t n);
+
+void ss_encrypt_lz_r(
+    const uint8_t *lzbuf, size_t lzlen, FILE *outfile, const mpz_t n, SSScratch *scratch);
+
+//
+// Progress of a ciphertext built up by ss_encrypt_append, saved between
+// runs so a growing input only has its new bytes encrypted.
+//
+typedef struct {
+    uint64_t key;     // ss_fingerprint of the public key
+    uint64_t in_off;  // input bytes covered by complete blocks
+    uint64_t out_off; // ciphertext bytes holding those blocks
+    uint64_t partial; // input bytes in the short block written after out_off
+} SSAppendState;
+
+//
+// Fingerprint of public key n, used to refuse appending under another key
+//
+uint64_t ss_fingerprint(const mpz_t n);
+
+//
+// Export append state to output stream
+//
+// Requires:
+//  st: state left by ss_encrypt_append
+//  stfile: open and writable file stream
+//
+void ss_write_append_state(const SSAppendState *st, FILE *stfile);
+
+//
+// Import append state from input stream
+//
+// Returns false if stfile does not hold a complete state.
+//
+// Requires:
+//  stfile: open and readable file stream
+//
+bool ss_read_append_state(SSAppendState *st, FILE *stfile);
+
+//
+// Encrypt the bytes appended to a file since the last call
+//
+// Provides:
+//  appends the encrypted contents of infile to outfile, the same blocks
+//  ss_encrypt_file would give for the whole input. st is advanced past
+//  every complete block, a short final block is written but left to be
+//  encrypted again once the input has grown.
+//
+// Requires:
+//  infile: open and readable file stream positioned at st->in_off
+//  outfile: open and writable file stream positioned at st->out_off
+//  n: public exponent and modulus
+//  st: state from the previous call, or zeroed with key set for a new file
+//
+void ss_encrypt_append(FILE *infile, FILE *outfile, const mpz_t n, SSAppendState *st);
+
 //
 // Decrypt number c into number m
 //
@@ -125,7 +282,10 @@ void ss_decrypt(mpz_t m, const mpz_t c, const mpz_t d, const mpz_t pq);
 // Decrypt a file back into its original form.
 //
 // Provides:
-//  fills outfile with the unencrypted data from infile
+//  fills outfile with the unencrypted data from infile, expanding it if
+//  it was encrypted with ss_encrypt_lz
+//
+// Returns false if compressed data turned out to be corrupt.
 //
 // Requires:
 //  infile: open and readable file stream to encrypted data
@@ -133,4 +293,46 @@ void ss_decrypt(mpz_t m, const mpz_t c, const mpz_t d, const mpz_t pq);
 //  d: private exponent
 //  pq: private modulus
 //
-void ss_decrypt_file(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t pq);
+bool ss_decrypt_file(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t pq);
+
+bool ss_decrypt_file_r(
+    FILE *infile, FILE *outfile, const mpz_t d, const mpz_t pq, SSScratch *scratch);
+
+//
+// Decrypt number c into number m using the factors of pq
+//
+// Provides:
+//  m: decrypted/original integer, the same as ss_decrypt gives
+//
+// Requires:
+//  c: encrypted integer
+//  d: private exponent
+//  p:  first prime
+//  q: second prime
+//  parallel: compute the mod p and mod q halves on two threads
+//  all mpz_t arguments to be initialized
+//
+void ss_decrypt_crt(
+    mpz_t m, const mpz_t c, const mpz_t d, const mpz_t p, const mpz_t q, bool parallel);
+
+//
+// Decrypt a file back into its original form using the factors of pq
+//
+// Provides:
+//  fills outfile with the same data ss_decrypt_file gives
+//
+// Returns false if compressed data turned out to be corrupt.
+//
+// Requires:
+//  infile: open and readable file stream to encrypted data
+//  outfile: open and writable file stream
+//  d: private exponent
+//  p:  first prime
+//  q: second prime
+//  parallel: compute the mod p and mod q halves of each block on two threads
+//
+bool ss_decrypt_file_crt(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t p,
+    const mpz_t q, bool parallel);
+
+bool ss_decrypt_file_crt_r(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t p,
+    const mpz_t q, bool parallel, SSScratch *scratch);